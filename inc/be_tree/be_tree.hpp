@@ -2,84 +2,430 @@
 #define BeTree_H
 
 #include <block_manager/block_manager.hpp>
+#include <bloom_filter/bloom_filter.hpp>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <serializable/serializable.hpp>
-
-// not used, just for reference
-#define EPSILON 0.5
-
-// Node: | is_leaf | parent | data |
-const int DATA_SIZE = BLOCK_SIZE - 2 * sizeof(uint32_t);
-// Leaf Node Data: | # entries | entries |
-const int LEAF_SIZE = DATA_SIZE;
-// Internal Node Data:
-// | # upserts | # flush | buffer (regular | flush) | # pivots | pivots |
-//  Pivot: Block size 4096B = 1024 keys. :sqrt = 32 keys => 128 bytes
-const int PIVOT_SIZE = 128;  // 15 pivots, 16 pointers, 1 size
-const int BUFFER_SIZE = DATA_SIZE - PIVOT_SIZE;
-const int NUM_CHILDREN = PIVOT_SIZE / (2 * sizeof(uint32_t));
-
-// Size Analysis for cost amortization
-// Alternatives: make unit size 16 bytes, instead of 8, to match upsert; use
-// larger block size and have BBST in buffers instead of lists
-const uint32_t FLUSH_THRESHOLD = 11;
-const uint32_t LEAF_FLUSH_THRESHOLD = 255;
-
-// Upsert Interface
-enum UpsertFunction : uint32_t { INSERT, DELETE, UPDATE, INVALID };
+#include <shared_mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <wal/wal.hpp>
+
+// Upsert Interface. A MERGE upsert folds its parameter into the value of the
+// key, or creates it, with the tree's merge operator (see [BeTree]), without
+// reading the key first. A DELETE_RANGE deletes every key in [key, end_key)
+// that is in the tree, as a single upsert.
+enum UpsertFunction : uint32_t {
+  INSERT,
+  DELETE,
+  UPDATE,
+  MERGE,
+  DELETE_RANGE,
+  INVALID
+};
+template <class Key, class Value>
 struct BeUpsert {
-  uint32_t key;
+  Key key;
   UpsertFunction type;
-  uint32_t parameter;
+  union {
+    Value parameter;
+    Key end_key;  // DELETE_RANGE only
+  };
   uint32_t timestamp;
 };
-bool SortBeUpsert(BeUpsert const &lhs, BeUpsert const &rhs);
+template <class Key, class Value>
+bool SortBeUpsert(BeUpsert<Key, Value> const &lhs,
+                  BeUpsert<Key, Value> const &rhs) {
+  return lhs.timestamp > rhs.timestamp;
+}
+// orders by key, then oldest to newest within a key
+template <class Key, class Value, class Compare>
+bool SortBeUpsertByKey(BeUpsert<Key, Value> const &lhs,
+                       BeUpsert<Key, Value> const &rhs) {
+  if (Compare()(lhs.key, rhs.key)) return true;
+  if (Compare()(rhs.key, lhs.key)) return false;
+  return lhs.timestamp < rhs.timestamp;
+}
 
 // Debug Functions
-void PrintUpsert(BeUpsert const &ups);
+void PrintUpsert(BeUpsert<uint32_t, uint32_t> const &ups);
 void CheckKeys();
 
-// Size Calculations
-const int NUM_DATA_PAIRS =
-    ((LEAF_SIZE - sizeof(uint32_t)) / sizeof(uint32_t)) / 2;
-const int NUM_UPSERTS =
-    (BUFFER_SIZE - 2 * sizeof(uint32_t)) / sizeof(struct BeUpsert);
-const int NUM_PIVOTS = ((PIVOT_SIZE - sizeof(uint32_t)) / sizeof(uint32_t)) / 2;
+/* A string of at most [N] bytes, stored zero padded in [N] bytes so it can be
+ * a fixed-width key or value. Ordered bytewise, like memcmp, so a string sorts
+ * before the strings it is a prefix of.
+ */
+template <size_t N>
+struct FixedString {
+  char bytes[N];
 
-// Constants
-const uint32_t KEY_NOT_FOUND = 4294967295;
+  /* Returns [s] padded to [N] bytes. Exits with an error if it is longer.
+   */
+  static FixedString From(const std::string &s) {
+    if (s.size() > N) {
+      fprintf(stderr, "string of %zu bytes is over %zu\n", s.size(), N);
+      exit(1);
+    }
+    FixedString res = {};
+    memcpy(res.bytes, s.data(), s.size());
+    return res;
+  }
+
+  std::string str() const { return std::string(bytes, strnlen(bytes, N)); }
+  bool operator<(const FixedString &other) const {
+    return memcmp(bytes, other.bytes, N) < 0;
+  }
+  bool operator==(const FixedString &other) const {
+    return memcmp(bytes, other.bytes, N) == 0;
+  }
+};
+
+// Merge operators for [BeTree]: [existing] is the value of the key, or
+// nullptr if it is not in the tree.
+//  - AddMerge: counters, adds the operand to the value (0 if absent)
+//  - MaxMerge: keeps the largest operand
+//  - AppendMerge: appends the operand string, exits with an error if the
+//    result does not fit
+template <class Value>
+Value AddMerge(const Value *existing, const Value &operand) {
+  return existing ? *existing + operand : operand;
+}
+template <class Value>
+Value MaxMerge(const Value *existing, const Value &operand) {
+  return existing && operand < *existing ? *existing : operand;
+}
+template <size_t N>
+FixedString<N> AppendMerge(const FixedString<N> *existing,
+                           const FixedString<N> &operand) {
+  if (!existing) return operand;
+  return FixedString<N>::From(existing->str() + operand.str());
+}
 
 enum FlushResult { SPLIT, NO_SPLIT, ENSURE_SPACE };
+// What coalescing an upsert with the one before it for the same key did
+enum CoalesceResult { KEPT_BOTH, FOLDED, CANCELLED };
+
+// Compile time helpers for the size calculations
+constexpr uint32_t Gcd(uint32_t a, uint32_t b) {
+  return b == 0 ? a : Gcd(b, a % b);
+}
+
+constexpr long double Power(long double base, uint32_t exp) {
+  long double res = 1;
+  for (uint32_t i = 0; i < exp; ++i) res *= base;
+  return res;
+}
+
+constexpr uint32_t AlignUp(uint32_t n, uint32_t align) {
+  return (n + align - 1) / align * align;
+}
+
+// floor(base^(num/den))
+constexpr uint32_t FloorRationalPower(uint32_t base, uint32_t num,
+                                      uint32_t den) {
+  long double target = Power(base, num);
+  uint32_t lo = 1, hi = base;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo + 1) / 2;
+    if (Power(mid, den) <= target)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/* Size Calculations for a tree with [BlockSize] byte blocks, epsilon =
+ * [EpsilonPercent] / 100, and fixed-width [Key]s and [Value]s. With B pairs
+ * per leaf, internal nodes get B^epsilon children and spend the rest of the
+ * block on the upsert buffer. Padding is counted so every field is aligned.
+ */
+template <uint32_t BlockSize, uint32_t EpsilonPercent, class Key, class Value>
+struct BeGeometry {
+  static_assert(EpsilonPercent > 0 && EpsilonPercent < 100,
+                "epsilon must be in (0, 1)");
+  static_assert(std::is_trivially_copyable<Key>::value &&
+                    std::is_trivially_copyable<Value>::value,
+                "keys and values are stored as raw bytes");
+  typedef Key KeyType;
+  typedef Value ValueType;
+  typedef BeUpsert<Key, Value> Upsert;
+
+  // Node: | is_leaf | data |
+  static constexpr int HEADER_SIZE =
+      AlignUp(sizeof(uint32_t), alignof(Upsert));
+  static constexpr int DATA_SIZE = BlockSize - HEADER_SIZE;
+  // Leaf Node Data: | # entries | keys | values |
+  static constexpr int LEAF_SIZE = DATA_SIZE;
+  static constexpr int NUM_DATA_PAIRS =
+      (LEAF_SIZE - AlignUp(sizeof(uint32_t), alignof(Key)) -
+       (alignof(Value) > alignof(Key) ? alignof(Value) - alignof(Key) : 0)) /
+      (sizeof(Key) + sizeof(Value));
+  // Packed Leaf Node Data: | # entries | # key bytes | keys | values |
+  static constexpr int PACKED_BYTES = LEAF_SIZE - 2 * sizeof(uint32_t);
+
+  // Internal Node Data:
+  // | # upserts | # ranges | # upserts per child | buffer | # pivots | pivots |
+  // pointers |
+  static constexpr int NUM_CHILDREN = FloorRationalPower(
+      NUM_DATA_PAIRS, EpsilonPercent / Gcd(EpsilonPercent, 100),
+      100 / Gcd(EpsilonPercent, 100));
+  static constexpr int NUM_PIVOTS = NUM_CHILDREN - 1;
+  static constexpr int PIVOT_SIZE = AlignUp(
+      AlignUp(AlignUp(sizeof(uint32_t), alignof(Key)) +
+                  NUM_PIVOTS * sizeof(Key),
+              alignof(uint32_t)) +
+          NUM_CHILDREN * sizeof(uint32_t),
+      alignof(Upsert));
+  static constexpr int BUFFER_SIZE = DATA_SIZE - PIVOT_SIZE;
+  static constexpr int NUM_UPSERTS =
+      (BUFFER_SIZE -
+       AlignUp((2 + NUM_CHILDREN) * sizeof(uint16_t), alignof(Upsert))) /
+      sizeof(Upsert);
+
+  // Size Analysis for cost amortization: a flush moves at least a child's
+  // share of a full buffer, a leaf takes at most half a leaf per flush
+  static constexpr uint32_t FLUSH_THRESHOLD = NUM_UPSERTS / NUM_CHILDREN;
+  static constexpr uint32_t LEAF_FLUSH_THRESHOLD = 1 + (NUM_DATA_PAIRS + 1) / 2;
+
+  static_assert(NUM_CHILDREN >= 4, "fanout too small to split internal nodes");
+  static_assert(FLUSH_THRESHOLD >= 1, "no room for an upsert buffer");
+  static_assert(NUM_UPSERTS <= 65535, "upsert counts are 16 bits");
+  // a flush batch comes from a single buffer, so merging one into a full leaf
+  // leaves at most two leaves worth of pairs
+  static_assert(NUM_UPSERTS <= NUM_DATA_PAIRS, "flush batch exceeds a leaf");
+  // each upsert grows a packed leaf by at most one key and one value varint
+  // (10 bytes), so splitting the result by bytes leaves two halves that fit
+  static_assert((PACKED_BYTES + 10 * LEAF_FLUSH_THRESHOLD) / 2 + 14 <=
+                    PACKED_BYTES,
+                "flush batch can overflow both halves of a packed leaf");
+};
 
+// The [is_leaf] header of a node: 0 for internal nodes, else how the leaf
+// stores its pairs. Split leaves keep their format, so the format of a tree's
+// first leaves is that of all of them.
+//  - PLAIN_LEAF: sorted arrays of keys and values ([BeData])
+//  - PACKED_LEAF: varint-encoded, for dense keys and small values
+//    ([BePackedData])
+enum LeafFormat : uint32_t { PLAIN_LEAF = 1, PACKED_LEAF = 2 };
+
+// Upserts sorted with [SortBeUpsertByKey]. Since the children partition the
+// keys, this groups them by child: [counts] holds the size of each group. A
+// DELETE_RANGE is cut at the pivots into one upsert for each child it covers,
+// and [num_ranges] counts them so lookups can skip looking for one.
+template <class Geometry>
 struct BeBuffer {
-  uint32_t size;
-  uint32_t flush_size;
-  struct BeUpsert buffer[NUM_UPSERTS];
+  uint16_t size;
+  uint16_t num_ranges;
+  uint16_t counts[Geometry::NUM_CHILDREN];
+  typename Geometry::Upsert buffer[Geometry::NUM_UPSERTS];
 };
-int SerializeBeBuffer(Block *disk_store, int pos, struct BeBuffer *buffer);
 
+template <class Geometry>
 struct BePivots {
   uint32_t size;
-  uint32_t pivots[NUM_PIVOTS];
-  uint32_t pointers[NUM_PIVOTS + 1];
+  typename Geometry::KeyType pivots[Geometry::NUM_PIVOTS];
+  uint32_t pointers[Geometry::NUM_PIVOTS + 1];
 };
-int SerializeBePivots(Block *disk_store, int pos, struct BePivots *pivots);
 
+// Leaf pairs, kept sorted by key
+template <class Geometry>
 struct BeData {
   uint32_t size;
-  uint32_t keys[NUM_DATA_PAIRS];
-  uint32_t values[NUM_DATA_PAIRS];
+  typename Geometry::KeyType keys[Geometry::NUM_DATA_PAIRS];
+  typename Geometry::ValueType values[Geometry::NUM_DATA_PAIRS];
+};
+
+// Packed leaf pairs, in key order: [key_bytes] bytes of keys, each a varint
+// of its difference from the previous key (the first from 0), then the values
+// as varints. A key that is close to the previous one and a value below 128
+// take a byte each, but lookups decode the pairs one after the other. Only
+// for uint32_t keys in increasing order and uint32_t values.
+template <class Geometry>
+struct BePackedData {
+  uint32_t size;
+  uint32_t key_bytes;
+  unsigned char bytes[Geometry::PACKED_BYTES];
+};
+
+// Block 0 of a tree, which the [BlockManager] never hands out to nodes.
+// Written whenever the tree is opened or closed, so the tree can be reopened
+// without reading anything else.
+struct BeSuperblock {
+  uint32_t magic;
+  // the geometry the tree was built with
+  uint32_t block_size;
+  uint32_t epsilon_percent;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t root_id;
+  uint32_t num_blocks;
+  // of the newest upsert
+  uint32_t timestamp;
+  // whether the tree was closed; an open tree's blocks may be out of date
+  uint32_t clean;
+  // the first block of the list of deleted blocks (see
+  // [BlockManager::SaveFreeList]), 0 if none
+  uint32_t free_list;
+};
+
+// Whether a [BeTree] constructor starts a new tree or reopens an existing one
+enum OpenMode { CREATE_TREE, OPEN_TREE };
+
+// Size the write-ahead log of a durable tree may grow to before the tree is
+// checkpointed and the log emptied
+#define CHECKPOINT_LOG_BYTES (16 << 20)
+
+// A node a flush leaves less than [MERGE_BELOW_PERCENT] full is merged with a
+// sibling if the two fill at most [MERGE_UP_TO_PERCENT] of a node, and evened
+// out with it otherwise
+#define MERGE_BELOW_PERCENT 25
+#define MERGE_UP_TO_PERCENT 75
+
+/* Counts values in power of two buckets: [buckets][i] counts the values in
+ * [2^i, 2^(i+1)), with 0 in bucket 0 and the values past 2^32 in the last.
+ */
+struct BeHistogram {
+  static const int NUM_BUCKETS = 33;
+  uint64_t buckets[NUM_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+
+  void Add(uint64_t value);
+  double Mean() const { return count ? (double)sum / count : 0.0; }
+
+  /* Returns a bound that [percent]% of the values are at most: the top of
+   * the bucket holding that rank, capped at [max]. 0 if there are none.
+   */
+  uint64_t Percentile(double percent) const;
 };
 
+/* What a [BeTree] has done since it was created or opened (see
+ * [BeTree::GetStats]).
+ */
+struct BeStats {
+  // Block I/O, none of it counted for MMAP trees: blocks read and written
+  // back, opens that found the block cached and that had to load it, blocks
+  // read ahead, and copies saved to the undo file of a durable tree
+  uint64_t block_reads, block_writes;
+  uint64_t cache_hits, cache_misses;
+  uint64_t prefetches, undo_saves;
+  // blocks in the store, and how many of them are free for reuse
+  uint64_t num_blocks, free_blocks;
+
+  // nodes flushed into one of their children
+  uint64_t node_flushes;
+  // nodes flushed by each full flush from the root: 1 if the child had room
+  // for the batch, more as the flush cascades down. [count] is the number of
+  // full flushes.
+  BeHistogram flush_cascades;
+  // upserts moved by each flush into an internal node and into a leaf
+  BeHistogram internal_flush_sizes, leaf_flush_sizes;
+  uint64_t leaf_splits, internal_splits;
+  // underfull nodes merged into a sibling, and evened out with one instead
+  uint64_t merges, rebalances;
+
+  // bytes of keys and values passed in by upserts and bulk loads
+  uint64_t user_bytes;
+  // bytes written to disk for them: blocks, undo copies and the log
+  uint64_t bytes_written;
+
+  // leaf filter checks, reads they saved, and keys they let through that
+  // were not in the leaf
+  uint64_t filter_checks, filter_negatives, filter_false_positives;
+
+  /* Bytes written to disk per user byte.
+   */
+  double WriteAmplification() const {
+    return user_bytes ? (double)bytes_written / user_bytes : 0.0;
+  }
+};
+
+/* The tree and its nodes are specialized on the block size and epsilon (see
+ * [BeGeometry]), and on fixed-width [Key] and [Value] types ordered by
+ * [Compare]. The instantiations are listed at the end of be_tree.cpp: uint32_t
+ * keys and values (the default) with 4 KB blocks and epsilon 0.5 (the
+ * default) or 0.3, and 64 KB blocks with epsilon 0.5; and 32 byte string keys
+ * with 16 byte string values in 4 KB blocks with epsilon 0.5.
+ */
+template <uint32_t BlockSize, uint32_t EpsilonPercent, class Key, class Value,
+          class Compare>
 class BeNode;  // forward declaration
+template <uint32_t BlockSize = 4096, uint32_t EpsilonPercent = 50,
+          class Key = uint32_t, class Value = uint32_t,
+          class Compare = std::less<Key> >
 class BeTree {
+  typedef BeNode<BlockSize, EpsilonPercent, Key, Value, Compare> Node;
+
+ public:
+  // Receives the key/value pairs produced by a range scan, in key order
+  typedef std::function<void(const Key &key, const Value &value)> ScanVisitor;
+  // Produces the key/value pairs for a bulk load one at a time, in increasing
+  // key order. Returns false once there are none left.
+  typedef std::function<bool(Key &key, Value &value)> PairSource;
+  // Returns the value of a key after a MERGE of [operand], given its value
+  // before ([existing], nullptr if absent). Must be associative, so that
+  // merging operands a then b equals merging the operand op(&a, b): merges
+  // are folded together wherever they meet.
+  typedef std::function<Value(const Value *existing, const Value &operand)>
+      MergeOperator;
+
+ private:
+
   // The underlying name of the folder where the tree is stored.
   std::string name;
 
   // The root of the BeTree. Dynamically allocated.
-  BeNode *root;
+  Node *root;
   // The BlockManager for this tree. Dynamically allocated.
-  BlockManager *bmanager;
+  BlockManager<BlockSize> *bmanager;
+
+  // Held shared by [Query] and exclusively by everything else, so queries can
+  // run in parallel with each other but never with a write.
+  std::shared_mutex tree_lock;
+  // The timestamp of the newest upsert.
+  uint32_t timestamp;
+  // The log of every upsert since the last checkpoint, for durable trees.
+  // Dynamically allocated, nullptr otherwise.
+  WriteAheadLog *wal;
+  // Applies MERGE upserts, nullptr if the tree has none.
+  MergeOperator merge_op;
+  // Lets [Query] skip reading the leaves that cannot hold the key.
+  LeafFilters leaf_filters;
+  // Counted by the tree and its nodes; [GetStats] adds the rest.
+  BeStats stats;
+
+  /* Writes every modified block back, then the superblock for the current
+   * root, and syncs both, so the tree on disk is whole. For a durable tree
+   * this is a checkpoint: the block store keeps this state to go back to,
+   * and the log starts over.
+   *
+   * Side Effects: Marks the tree [clean] (closed) or not on disk.
+   */
+  void WriteSuperblock(bool clean);
+
+  /* Adds an upsert with the given values to the root, flushing first if it
+   * is full. Must hold [tree_lock] exclusively.
+   */
+  void RootUpsert(const Key &key, UpsertFunction type, const Value &parameter,
+                  uint32_t timestamp);
+
+  /* Adds the [num] stamped upserts in [upserts], sorted with
+   * [SortBeUpsertByKey], to the root in chunks as large as its free space,
+   * flushing in between. Must hold [tree_lock] exclusively.
+   */
+  void RootUpserts(const BeUpsert<Key, Value> upserts[], size_t num);
+
+  /* Logs the [num] upserts in [upserts] as one record, and checkpoints if the
+   * log grew too big. Must hold [tree_lock] exclusively.
+   * Return: The sequence number to commit once [tree_lock] is released.
+   */
+  uint64_t LogUpserts(const BeUpsert<Key, Value> upserts[], size_t num);
 
   /* Creates a new root for the tree. The parameters are the key on which
    * the previous root split, and the id of the (right) split node.
@@ -87,86 +433,282 @@ class BeTree {
    * Side Effects: Changes the id of [root].
    * Return: None.
    */
-  void CreateNewRoot(uint32_t split_key, uint32_t new_id);
+  void CreateNewRoot(const Key &split_key, uint32_t new_id);
 
-  /* Performs a full flush from the root of the tree.
+  /* Performs a full flush from the root of the tree, then collapses the
+   * root (see [CollapseRoot]).
    *
    * Side Effects: Can potentially effect the entire tree as it flushes
    * upserts down. Return: None.
    */
   void FullFlush();
 
+  /* Replaces a root left with a single internal child by merges with that
+   * child, after flushing the child until it has room for the root's
+   * upserts. Does nothing to any other root.
+   */
+  void CollapseRoot();
+
   /* Adds the specified upsert to the root node, flushing (lazily) if necessary.
+   * A durable tree has it on disk in the log before returning.
    */
-  void Upsert(uint32_t key, UpsertFunction type, uint32_t parameter);
+  void Upsert(const Key &key, UpsertFunction type, const Value &parameter);
 
  public:
-  BeTree(std::string _name);
+  /* Creates an empty tree stored under ./build/app/[_name]. [blocks_in_memory]
+   * and [policy] size and manage the block cache; they are ignored for [MMAP],
+   * which leaves caching to the kernel.
+   *
+   * A [durable] tree logs every upsert to a write-ahead log before the call
+   * returns, with concurrent writers sharing syncs, and so survives a crash.
+   * Not for [MMAP], whose blocks cannot be held back from the disk.
+   *
+   * [leaf_format] is how the leaves store their pairs (see [LeafFormat]).
+   * [_merge_op] is applied by [Merge], e.g. [AddMerge] for counters.
+   */
+  BeTree(std::string _name,
+         uint32_t blocks_in_memory = DEFAULT_BLOCKS_IN_MEMORY,
+         StorageMode mode = SINGLE_FILE,
+         EvictionPolicyType policy = LRU_POLICY, bool durable = false,
+         LeafFormat leaf_format = PLAIN_LEAF,
+         const MergeOperator &_merge_op = nullptr);
+
+  /* As above for [CREATE_TREE]. [OPEN_TREE] reopens the tree stored under
+   * ./build/app/[_name] by a previous [BeTree] with the same geometry and
+   * storage layout, reading only its superblock and root. A [durable] tree
+   * that crashed goes back to its last checkpoint and replays its log. The
+   * leaves keep the format they were created with, [leaf_format] is ignored.
+   * Merge operators are not stored, a tree with merges must be reopened with
+   * the same [_merge_op].
+   *
+   * Throws an error if there is no such tree, or it was not closed cleanly
+   * and is not reopened as [durable].
+   */
+  BeTree(std::string _name, OpenMode open_mode,
+         uint32_t blocks_in_memory = DEFAULT_BLOCKS_IN_MEMORY,
+         StorageMode mode = SINGLE_FILE,
+         EvictionPolicyType policy = LRU_POLICY, bool durable = false,
+         LeafFormat leaf_format = PLAIN_LEAF,
+         const MergeOperator &_merge_op = nullptr);
+
+  /* Closes the tree, leaving it on disk to be reopened with [OPEN_TREE].
+   */
   ~BeTree();
 
   /* Insert the [key]/[val] pair into the tree.
    *
    * Throws an error if the key is already in the tree.
    */
-  void Insert(uint32_t key, uint32_t val);
+  void Insert(const Key &key, const Value &val);
 
   /* Update the [key] with the new [val] in the tree.
    *
    * Throws an error if the key is not already in the tree.
    */
-  void Update(uint32_t key, uint32_t val);
+  void Update(const Key &key, const Value &val);
 
   /* Delete the [key] from the tree.
    *
    * Throws an error if the key is not in the tree.
    */
-  void Delete(uint32_t key);
+  void Delete(const Key &key);
+
+  /* Delete every key in [[lo], [hi]) that is in the tree, with a single
+   * upsert that truncates the leaves it reaches. Unlike [Delete], keys that
+   * are not in the tree are skipped.
+   */
+  void DeleteRange(const Key &lo, const Key &hi);
 
-  /* Queries for the key in the tree, returns a sentinel value if it is not
-   * found.
+  /* Merge [operand] into the value of [key] with the tree's merge operator,
+   * creating the key if it is not in the tree. Blind: nothing is read, the
+   * merge is applied when it reaches the leaf or a query finds it.
+   *
+   * Throws an error if the tree has no merge operator.
+   */
+  void Merge(const Key &key, const Value &operand);
+
+  /* Queries for the key in the tree, putting its value in [value].
+   * Safe to call from many threads at once.
+   *
+   * Return: Whether the key is in the tree.
+   */
+  bool Query(const Key &key, Value &value);
+
+  /* Calls [visit] on every key/value pair with [lo] <= key < [hi], in
+   * increasing key order. Reads each buffer and leaf in the range once. An
+   * [MMAP] tree is advised for sequential access for the duration.
+   */
+  void Scan(const Key &lo, const Key &hi, const ScanVisitor &visit);
+
+  /* Returns every key/value pair with [lo] <= key < [hi], in key order.
+   */
+  std::vector<std::pair<Key, Value> > Scan(const Key &lo, const Key &hi);
+
+  /* Applies the [num] upserts in [upserts] as if they were upserted one at a
+   * time in array order, with one pass over the root buffer for each chunk
+   * that fits in it instead of one per upsert. Only [key], [type] and
+   * [parameter] (or [end_key]) are read.
+   *
+   * Side Effects: Sorts [upserts] with [SortBeUpsertByKey] after stamping
+   * their timestamps, drops the upserts a later DELETE_RANGE in the batch
+   * overrides, and coalesces those for the same key (see
+   * [BeNode::Coalesce]).
+   * Return: How many upserts are left, at the start of [upserts].
+   */
+  size_t ApplyBatch(BeUpsert<Key, Value> upserts[], size_t num);
+
+  /* Fills a newly created tree with the pairs from [next], whose keys must be
+   * strictly increasing, building it bottom-up instead of inserting them one
+   * at a time. Leaves are packed full and internal nodes get [fill_factor]
+   * of the most children they can hold. Every block is created in order and
+   * written once.
+   *
+   * Throws an error if the tree is not empty.
    */
-  uint32_t Query(uint32_t key);
+  void BulkLoad(const PairSource &next, double fill_factor = 1.0);
+
+  /* [BulkLoad] from the sorted pairs in [begin, end) (e.g. the iterators of a
+   * std::map or a sorted vector of std::pair).
+   */
+  template <class Iterator>
+  void BulkLoad(Iterator begin, Iterator end, double fill_factor = 1.0) {
+    BulkLoad(
+        [&begin, &end](Key &key, Value &value) {
+          if (begin == end) return false;
+          key = begin->first;
+          value = begin->second;
+          ++begin;
+          return true;
+        },
+        fill_factor);
+  }
+
+  /* Returns the tree's counters since it was created or opened (see
+   * [BeStats]). Counting costs an increment or two per flush, split or
+   * merge. Safe to call from many threads at once, alongside queries.
+   */
+  BeStats GetStats();
 };
 
-class BeNode : public Serializable {
+template <uint32_t BlockSize = 4096, uint32_t EpsilonPercent = 50,
+          class Key = uint32_t, class Value = uint32_t,
+          class Compare = std::less<Key> >
+class BeNode : public Serializable<BlockSize> {
+  typedef BeGeometry<BlockSize, EpsilonPercent, Key, Value> Geometry;
+  typedef BeTree<BlockSize, EpsilonPercent, Key, Value, Compare> Tree;
+  typedef typename Tree::ScanVisitor ScanVisitor;
+  typedef typename Tree::MergeOperator MergeOperator;
+  static constexpr int NUM_DATA_PAIRS = Geometry::NUM_DATA_PAIRS;
+  static constexpr int PACKED_BYTES = Geometry::PACKED_BYTES;
+  static constexpr int NUM_CHILDREN = Geometry::NUM_CHILDREN;
+  static constexpr int NUM_PIVOTS = Geometry::NUM_PIVOTS;
+  static constexpr int NUM_UPSERTS = Geometry::NUM_UPSERTS;
+  static constexpr uint32_t FLUSH_THRESHOLD = Geometry::FLUSH_THRESHOLD;
+  static constexpr uint32_t LEAF_FLUSH_THRESHOLD =
+      Geometry::LEAF_FLUSH_THRESHOLD;
+  // Whether the keys are uint32_t in increasing order, which the SIMD pivot
+  // search needs, and whether the leaves can also be packed (values uint32_t)
+  static constexpr bool UINT32_KEYS =
+      std::is_same<Key, uint32_t>::value &&
+      std::is_same<Compare, std::less<uint32_t> >::value;
+  static constexpr bool PACKABLE =
+      UINT32_KEYS && std::is_same<Value, uint32_t>::value;
+
   // Used to load the Node from memory
-  BlockManager *bmanager;
+  BlockManager<BlockSize> *bmanager;
   uint32_t id;
+  // The tree's merge operator, leaf filters and counters, passed on to the
+  // nodes opened from this one
+  const MergeOperator *merge_op;
+  LeafFilters *filters;
+  // The tree's counters, nullptr to count nothing
+  BeStats *stats;
+  // Keeps the block in memory while the node is alive, so the pointers below
+  // stay valid
+  BlockHandle<BlockSize> handle;
 
   // Node data, loaded from file
-  uint32_t *parent;   // id of the parent block
   uint32_t *is_leaf;  // whether or not the block is a leaf
-  struct BeBuffer *buffer;
-  struct BePivots *pivots;
-  struct BeData *data;
+  struct BeBuffer<Geometry> *buffer;
+  struct BePivots<Geometry> *pivots;
+  struct BeData<Geometry> *data;
+  struct BePackedData<Geometry> *packed;
 
   /* Returns the index into [pivots->pointers] of the [key].
    */
-  int IndexOfKey(uint32_t key);
+  int IndexOfKey(const Key &key);
+
+  /* Copies the pairs of this leaf, in either format, to [keys]/[values].
+   */
+  void ReadLeaf(std::vector<Key> &keys, std::vector<Value> &values);
+
+  /* Points [keys]/[values] at the pairs of this leaf: into the block for a
+   * plain leaf, which copies nothing, else decoded into
+   * [packed_keys]/[packed_values].
+   *
+   * Return: How many pairs there are.
+   */
+  int ViewLeaf(std::vector<Key> &packed_keys,
+               std::vector<Value> &packed_values, const Key *&keys,
+               const Value *&values);
+
+  /* Replaces the pairs of this leaf with the [size] sorted pairs in
+   * [keys]/[values], in the leaf's format, and rebuilds its filter (see
+   * [SetFilter]).
+   *
+   * Return: Whether they fit. If not, the leaf is left as it was.
+   */
+  bool WriteLeaf(const Key keys[], const Value values[], int size);
+
+  /* Builds the filter of this leaf over the [size] keys in [keys], if the
+   * node has [filters].
+   */
+  void SetFilter(const Key keys[], int size);
 
-  /* Ensures that the current [Node] is "open" (the underlying [Block] is
-   * loaded in memory).
+  /* Looks up [key] in this leaf, putting its value in [value].
+   * Return: Whether the key is in the leaf.
+   */
+  bool FindInLeaf(const Key &key, Value &value);
+
+  /* Pins the block of node [id] and points the node data into it. Done once,
+   * when the node is created or its id changes.
    */
   void Open();
 
-  /* Applies up to [num] upserts to the leaf node, backwards in [upsert]
+  /* Marks the underlying [Block] as modified. Must be called by every path
+   * that writes to the node while it is open.
+   */
+  void MarkDirty();
+
+  /* Applies the [num] upserts in [upsert], sorted with [SortBeUpsertByKey], to
+   * the leaf node as a single sorted merge. Splits the leaf if the result does
+   * not fit.
    *
-   * Side Effects: [num] always represents the number of upserts left that have
-   *               not been applied.
-   * Return: whether or not the leaf is full (and needs to be split)
+   * Side Effects: Can create a new leaf (see [SplitLeaf]).
+   * Return:
+   *  - Whether or not the leaf split
+   *  - Sets [split_key] and [new_id] as [SplitLeaf] does, if split
+   */
+  bool UpsertLeaf(BeUpsert<Key, Value> upsert[], int num, Key &split_key,
+                  uint32_t &new_id);
+
+  /* Returns where to cut the [size] sorted pairs in [keys]/[values] in half,
+   * by their encoded size in a packed leaf, leaving a pair on each side.
    */
-  bool UpsertLeaf(struct BeUpsert upsert[], int &num);
+  int HalfOf(const Key keys[], const Value values[], int size);
 
-  /* Splits the leaf node in half
+  /* Splits the [size] sorted pairs in [keys]/[values] in half (see [HalfOf])
+   * between this leaf and a new one of the same format.
    *
    * Side Effects:
-   *  - Creates a new node and distributes keys evenly between the two nodes
-   *  - Sorts the keys
+   *  - Creates a new node holding the upper half of the pairs
+   *  - Overwrites the pairs of this node with the lower half
    * Return:
    *  - Returns the key of the split (lower bound of upper node)
    *  - Puts the id of the new node in [new_id]
    */
-  uint32_t SplitLeaf(uint32_t &new_id);
+  Key SplitLeaf(const Key keys[], const Value values[], int size,
+                uint32_t &new_id);
 
   /* Splits the internal node in half
    *
@@ -174,24 +716,114 @@ class BeNode : public Serializable {
    *  - Creates a new node
    *  - Distributes the pivots/pointers evenly between the two nodes, dropping
    *    the middle pivot
-   *  - Distributes the upsert buffer correctly, including the flush buffer
+   *  - Moves the upserts of the moved children to the new node
    * Return:
    *  - Returns the key of the split (lower bound of upper node)
    *  - Puts the id of the new node in [new_id]
    */
-  uint32_t SplitInternal(uint32_t &new_id);
+  Key SplitInternal(uint32_t &new_id);
 
-  /* Finds the child with the maximum number of outstanding upserts and reorders
-   * the [buffer] in the node so that these upserts are in the flush region.
+  /* Returns how full the node is, in percent: by the bytes of its pairs for
+   * a leaf, by its children for an internal node.
+   */
+  int FillPercent();
+
+  /* Merges the child at [child_index] and the next one into the first, or
+   * evens them out if they do not fit in [MERGE_UP_TO_PERCENT] of a node
+   * (see [MergeLeaf], [MergeInternal]). Internal children are flushed first
+   * until their upserts fit in one buffer.
    *
-   * Side Effects:
-   *  - Sets [buffer->flush_size] to the number of flushable elements.
-   * Return: None
+   * Side Effects: Deletes the second child if merged, else moves the pivot
+   * between them and the upserts that cross it.
    */
-  void FullFlushSetup();
+  void MergeChildren(int child_index);
 
-  /* Flushes from an internal node to its child leaf, [child_node]. Splits if
-   * necessary.
+  /* Merges the pairs of the next leaf [right] into this one, or evens them
+   * out between the two if that does not leave room (see [MergeChildren]).
+   *
+   * Side Effects: Deletes [right] if merged.
+   * Return: Whether [right] is kept, with its lowest key in [split_key].
+   */
+  bool MergeLeaf(BeNode &right, Key &split_key);
+
+  /* As [MergeLeaf], for the next internal node [right], the pivot between
+   * them in the parent being [separator]. Buffers are moved with their
+   * children; they are left alone if either node would overflow.
+   */
+  bool MergeInternal(BeNode &right, const Key &separator, Key &split_key);
+
+  /* Deletes the block of this node, which must not be used after.
+   */
+  void Free();
+
+  /* Returns the index into [buffer->buffer] of the first upsert for the child
+   * at [child_index].
+   */
+  int GroupStart(int child_index);
+
+  /* Returns the index of the child with the maximum number of outstanding
+   * upserts. Only looks at [buffer->counts].
+   */
+  int FullestChild();
+
+  /* Returns [existing] (nullptr if absent) after merging [operand] with
+   * [merge_op]. Throws an error if there is no merge operator.
+   */
+  Value ApplyMerge(const Value *existing, const Value &operand);
+
+  /* Replaces [last] and [upsert], the next upsert for the same key, with one
+   * upsert or none when that has the same effect on the key:
+   *  - a MERGE folds into an INSERT, UPDATE or MERGE
+   *  - an UPDATE replaces the value of an INSERT or UPDATE
+   *  - a DELETE cancels an INSERT, and replaces an UPDATE, MERGE or DELETE
+   * Other pairs are kept, but a MERGE after a DELETE becomes the INSERT of
+   * the merge into nothing. A buffer thus never holds more than three valid
+   * upserts for a key. The one upsert left is [last], with the timestamp of
+   * [upsert]. An invalid pair that cancels (INSERT of an existing key then
+   * DELETE) is no longer caught when it reaches the leaf, nor is a DELETE of
+   * an absent key, which a DELETE replacing a MERGE can be.
+   *
+   * Return: [FOLDED] into [last], [CANCELLED] (drop [last] too) or
+   * [KEPT_BOTH].
+   */
+  CoalesceResult Coalesce(BeUpsert<Key, Value> &last,
+                          BeUpsert<Key, Value> &upsert);
+
+  /* Coalesces the runs of upserts for each key in the [num] upserts in
+   * [upserts], sorted with [SortBeUpsertByKey] (see [Coalesce]).
+   *
+   * Return: How many upserts are left, at the start of [upserts].
+   */
+  int CoalesceUpserts(BeUpsert<Key, Value> upserts[], int num);
+
+  /* Merges the [num] upserts in [upserts], sorted with [SortBeUpsertByKey],
+   * into the buffer of this internal node, coalescing those for the same key
+   * (see [CoalesceUpserts]), so every flush batch taken from the buffer is
+   * already coalesced. DELETE_RANGEs go in first (see [DeleteRange]); no
+   * other upsert in [upserts] may be older than a DELETE_RANGE covering it.
+   * Assumes there is space for [num] upserts.
+   *
+   * Side Effects: Updates [buffer->counts].
+   */
+  void AddUpserts(const BeUpsert<Key, Value> upserts[], int num);
+
+  /* Applies the DELETE_RANGE [range] to the tree rooted at this node. A leaf
+   * drops its pairs in the range. An internal node drops the older upserts in
+   * the range from its buffer and adds a piece of [range] for each child it
+   * covers, as long as that leaves room for [reserved] more upserts; the
+   * pieces that do not fit are applied to their child right away. Nothing
+   * under this node may be newer than [range] in its keys but the upserts
+   * in this buffer.
+   */
+  void DeleteRange(const BeUpsert<Key, Value> &range, int reserved);
+
+  /* Removes the first [num] upserts for the child at [child_index] from the
+   * buffer.
+   */
+  void RemoveUpserts(int child_index, int num);
+
+  /* Flushes the upserts for the child at [child_index] from an internal node
+   * to that child, the leaf [child_node]. Splits if necessary.
    *
    * Side Effects:
    *  - Updates the leaf [child_node] with upserts
@@ -201,48 +833,61 @@ class BeNode : public Serializable {
    *  - Sets [new_id] to the id of the new node, if split
    *  - Returns [SPLIT] or [NO_SPLIT]
    */
-  FlushResult FlushOneLeaf(BeNode &child_node, uint32_t &split_key,
-                           uint32_t &new_id);
+  FlushResult FlushOneLeaf(BeNode &child_node, int child_index,
+                           Key &split_key, uint32_t &new_id);
 
-  /* Tries to flush from an internal node to its internal node child,
-   * [child_node]. Uses clever cutoffs to ensure the amortization of the disk
-   * access against the number of items flushed.
+  /* Tries to flush the upserts for the child at [child_index] from an internal
+   * node to that child, the internal node [child_node]. Uses clever cutoffs to
+   * ensure the amortization of the disk access against the number of items
+   * flushed.
    *
-   * Side Effects:
-   *  - Flushes to [child_node] and updates it, if it can.
-   *  - *** unexpected behavior ***: If it can't flush, sets [node] id to the
-   *    child id.
+   * Side Effects: Flushes to [child_node] and updates it, if it can.
    * Return:
-   *  - [ENSURE_SPACE] or [NO_SPLIT]
+   *  - [ENSURE_SPACE] if the child needs to be flushed first, or [NO_SPLIT]
    */
-  FlushResult FlushOneInternal(BeNode &child_node);
-
-  /* Tries to flush the current node. Calls into [FlushOneLeaf] or
-   * [FlushOneInternal], depending on whether the current node is a leaf or not
-   * (respectively).
+  FlushResult FlushOneInternal(BeNode &child_node, int child_index);
+
+  /* Flushes the upserts for the child with the most outstanding upserts into
+   * it. Calls into [FlushOneLeaf] or [FlushOneInternal], depending on whether
+   * the child is a leaf or not (respectively), and recursively flushes an
+   * internal child first if it does not have space. Adds the pivots for any
+   * child splits, and splits the current node if its pivots fill up. A child
+   * left under [MERGE_BELOW_PERCENT] full is merged with a sibling (see
+   * [MergeChildren]).
    *
-   * Side Effects: See constituent functions.
-   * Return: See constituent functions.
+   * Side Effects: Can potentially affect the entire subtree.
+   * Return:
+   *  - Sets [split_key] and [new_id] as [SplitInternal] does, if split
+   *  - Returns [SPLIT] or [NO_SPLIT]
    */
-  FlushResult FlushOneLevel(uint32_t &split_key, uint32_t &new_id);
+  FlushResult FlushOneLevel(Key &split_key, uint32_t &new_id);
 
   /* Adds the given pivot to the current node. Assumes that there is space! This
    * is a valid assumption because every usage must be followed by a check as to
    * whether the node is full; if it is, this must be dealt with eagerly.
    *
-   * Side Effects: Adds a new pivot/pointer pair.
+   * Side Effects: Adds a new pivot/pointer pair, and divides the upserts of the
+   * split child between it and the new child, cutting the DELETE_RANGEs that
+   * cover both (see [DeleteRange]).
    * Return: Whether the current node's pivots are full.
    */
-  bool AddPivot(uint32_t split_key, uint32_t new_id);
+  bool AddPivot(const Key &split_key, uint32_t new_id);
 
   /* For debugging purposes: prints an internal node.
    */
   void PrintInternal();
 
-  friend class BeTree;
+  friend class BeTree<BlockSize, EpsilonPercent, Key, Value, Compare>;
 
  public:
-  BeNode(BlockManager *_bmanager, uint32_t _id);
+  /* Opens node [_id]; its block stays pinned until the node is destroyed or
+   * moved to another id. [_merge_op] is needed to apply MERGE upserts. Every
+   * node that writes leaves of a tree with [_filters] must have them, so the
+   * filters stay up to date. The node counts what it does in [_stats].
+   */
+  BeNode(BlockManager<BlockSize> *_bmanager, uint32_t _id,
+         const MergeOperator *_merge_op = nullptr,
+         LeafFilters *_filters = nullptr, BeStats *_stats = nullptr);
 
   /* Return this node's id.
    */
@@ -252,27 +897,49 @@ class BeNode : public Serializable {
    */
   void SetId(uint32_t new_id);
 
-  /* Insert a [BeUpsert] with the given values into this node.
+  /* Insert a [BeUpsert] with the given values into this node, coalesced
+   * with the last upsert for the key (see [Coalesce]). Not a DELETE_RANGE,
+   * which goes through [AddUpserts].
+   * [timestamp] must be newer than that of every upsert in the tree.
    *
    * Assumes that the node is an internal node, that there is space in its
    * upsert buffer, and that the key goes under this node.
    */
-  void Upsert(uint32_t key, UpsertFunction type, uint32_t parameter);
+  void Upsert(const Key &key, UpsertFunction type, const Value &parameter,
+              uint32_t timestamp);
+
+  /* Queries for the key in the tree rooted at the node, putting its value in
+   * [value]. Returns whether it was found. MERGE upserts found on the way down
+   * are applied to the first value below them, a DELETE_RANGE covering the
+   * key hides everything older than it. A leaf whose filter rules the key out
+   * is not read.
+   *
+   * Does not modify the node, and only pins each block while reading it, so
+   * any number of threads may query at once as long as nothing writes the
+   * tree.
+   */
+  bool Query(const Key &key, Value &value);
 
-  /* Queries for the key in the tree rooted at the node, returns a sentinel
-   * value if it is not found.
+  /* Visits the live pairs in [lo, hi) of the tree rooted at the node, in key
+   * order. [pending] holds the upserts for [lo, hi) collected from the
+   * ancestors, and the DELETE_RANGEs reaching into it, sorted with
+   * [SortBeUpsertByKey].
+   *
+   * Side Effects: Reorders [pending].
    */
-  uint32_t Query(uint32_t key);
+  void Scan(const Key &lo, const Key &hi,
+            std::vector<BeUpsert<Key, Value> > &pending,
+            const ScanVisitor &visit);
 
   /* Serializes the node to the given [pos] in [disk_store].
    *
    * Currently a no-op, because the data is loaded directly off disk.
    */
-  int Serialize(Block *disk_store, int pos);
+  int Serialize(Block<BlockSize> *disk_store, int pos);
 
   /* Deserializes the [BeNode] from the given [Block]: [disk_store].
    */
-  void Deserialize(const Block &disk_store);
+  void Deserialize(const Block<BlockSize> &disk_store);
 };
 
 #endif  // BeTree_H
@@ -1,37 +1,304 @@
 #ifndef BLOCK_MANAGER_H
 #define BLOCK_MANAGER_H
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
-#include <lru_cache/lru_cache.hpp>
+#include <deque>
+#include <eviction_policy/eviction_policy.hpp>
+#include <set>
+#include <shared_mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
-#define BLOCK_SIZE 4096
-#define BLOCKS_IN_MEMORY 16
-#define MEMORY_SIZE (BLOCK_SIZE * BLOCKS_IN_MEMORY)
+// Default number of blocks cached in memory
+#define DEFAULT_BLOCKS_IN_MEMORY 16
+// Seconds [Pin] waits for a frame while every one is pinned before giving up:
+// the pins are then held by callers that never release them
+#define PIN_WAIT_SECONDS 10
+// Number of blocks the single backing file is grown by at a time
+#define BLOCKS_PER_EXTENT 1024
+// Number of threads reading prefetched blocks in the background
+#define PREFETCH_THREADS 2
+// Address space reserved up front for an MMAP tree; the file can never grow
+// past it, but nothing is committed until an extent is mapped
+#define MMAP_RESERVE_BYTES (1ULL << 40)
 
+// How blocks are laid out on disk.
+//  - FILE_PER_BLOCK: one file per block id under the tree's folder
+//  - SINGLE_FILE: every block lives at [id * BlockSize] in one preallocated
+//    file, accessed through a long-lived descriptor with pread/pwrite
+//  - MMAP: the SINGLE_FILE layout, but mapped into memory. Blocks are used in
+//    place through [PinBlock] and the kernel page cache replaces the
+//    [internal_mem] cache, so there is no copying and no eviction in user space
+enum StorageMode { FILE_PER_BLOCK, SINGLE_FILE, MMAP };
+
+// Expected access pattern of an MMAP tree, passed on to madvise
+enum AccessHint { ACCESS_NORMAL, ACCESS_RANDOM, ACCESS_SEQUENTIAL };
+
+template <uint32_t BlockSize>
 class Block {
  public:
-  unsigned char block_buf[BLOCK_SIZE];
+  unsigned char block_buf[BlockSize];
+};
+
+template <uint32_t BlockSize>
+class BlockManager;  // forward declaration
+
+/* Keeps one block pinned in memory for as long as it lives (see
+ * [BlockManager::Pin]). Can be moved but not copied; an empty handle pins
+ * nothing.
+ */
+template <uint32_t BlockSize>
+class BlockHandle {
+  BlockManager<BlockSize> *bmanager;
+  Block<BlockSize> *block;
+
+ public:
+  BlockHandle() : bmanager(nullptr), block(nullptr) {}
+  BlockHandle(BlockManager<BlockSize> *_bmanager, Block<BlockSize> *_block)
+      : bmanager(_bmanager), block(_block) {}
+  BlockHandle(BlockHandle &&other);
+  BlockHandle &operator=(BlockHandle &&other);
+  BlockHandle(const BlockHandle &) = delete;
+  BlockHandle &operator=(const BlockHandle &) = delete;
+  ~BlockHandle() { Release(); }
+
+  /* Unpins the block early, leaving the handle empty.
+   */
+  void Release();
+
+  Block<BlockSize> *Get() const { return block; }
 };
 
+/* Caches [BlockSize] byte blocks of a tree in memory. Instantiated for the
+ * block sizes listed at the end of block_manager.cpp.
+ *
+ * Block ids start at 1. Block 0 is never handed out by [CreateBlock], so the
+ * owner can keep its own metadata there. Deleted blocks are reused by later
+ * [CreateBlock]s, and the list of them is kept in the free blocks themselves
+ * (see [SaveFreeList]).
+ *
+ * Any number of threads may [PinBlock]/[UnpinBlock]/[Prefetch] at once.
+ * Everything else must not run alongside any other call, except for the
+ * background prefetch reads, which it is safe against.
+ */
+template <uint32_t BlockSize>
 class BlockManager {
-  int num_reads, num_writes;
+  std::atomic<uint64_t> num_reads, num_writes;
+  // how many opens found the block in memory, and how many had to read it
+  std::atomic<uint64_t> num_hits, num_misses;
+  // how many blocks were read ahead of being opened
+  std::atomic<uint64_t> num_prefetches;
   std::string name;
+  StorageMode mode;
   uint32_t cur_num_blocks;
-  LRUCache *open_blocks;
+  uint32_t blocks_in_memory;
+  EvictionPolicyType policy;
+  EvictionPolicy *open_blocks;
+  // whether the block at each position in [internal_mem] differs from disk
+  bool *dirty;
+  // whether each block id was ever written back; the others are all zeros,
+  // so opening them needs no read
+  std::vector<bool> written;
+
+  // Concurrency state for each position in [internal_mem]: how many readers
+  // are using it (it is never evicted while pinned), and whether it is still
+  // being read from disk. [frame_lock] guards [open_blocks], [loading] and
+  // [written]: shared on hits, exclusive to give a block a position.
+  std::atomic<int> *pins;
+  bool *loading;
+  std::shared_mutex frame_lock;
+  std::condition_variable_any frame_loaded;
+
+  // Read-ahead: ids waiting to be read by the [prefetchers]
+  std::vector<std::thread> prefetchers;
+  std::deque<uint32_t> prefetch_queue;
+  std::mutex prefetch_lock;
+  std::condition_variable prefetch_ready;
+  bool stopping;
+
+  // SINGLE_FILE/MMAP state: the backing file and how many blocks it has room
+  // for
+  int fd;
+  uint32_t num_allocated_blocks;
+
+  // MMAP state: the reserved address range (the first [num_allocated_blocks]
+  // blocks of which map the file) and the hint applied to it
+  Block<BlockSize> *mapping;
+  AccessHint hint;
+
+  // Checkpoint state (SINGLE_FILE/FILE_PER_BLOCK): the undo file holding the
+  // checkpointed contents of the blocks overwritten since, the number of
+  // blocks at the checkpoint, and which of them are already saved
+  int undo_fd;
+  uint32_t checkpoint_blocks;
+  std::vector<bool> saved;
+  std::atomic<uint64_t> num_undo_saves;
+  // FILE_PER_BLOCK: the blocks whose files were written since the last sync
+  std::set<uint32_t> unsynced_files;
+
+  // Deleted ids, reused before the store grows; the first block of their
+  // list on disk, and whether they changed since it was written
+  std::set<uint32_t> free_ids;
+  uint32_t free_list_head;
+  bool free_list_changed;
+  int num_frees, num_reuses;
+
+  /* Returns the position of block [id] in [internal_mem], loading it if
+   * needed, with one more pin on it. [prefetch] loads are counted apart from
+   * opens.
+   */
+  uint32_t PinFrame(uint32_t id, bool prefetch = false);
+
+  /* Body of each of the [prefetchers]: loads queued ids until [stopping].
+   */
+  void PrefetchLoop();
 
   void WriteBlock(uint32_t id, int pos);
   void ReadBlock(uint32_t id, int pos);
+  void WriteToDisk(uint32_t id, const unsigned char *buf);
+  void ReadFromDisk(uint32_t id, unsigned char *buf);
   std::string BlockFilename(uint32_t id);
 
+  /* Waits until everything written so far is on disk: the block file, or
+   * the [unsynced_files] and the folder holding them, and the folder's new
+   * files.
+   */
+  void SyncFiles();
+  std::string UndoFilename();
+
+  /* Appends the contents block [id] has on disk to the undo file, and syncs
+   * it, before the block is overwritten for the first time since the last
+   * [Checkpoint].
+   */
+  void SaveUndo(uint32_t id);
+
+  /* Writes the saved contents of the undo file back over their blocks, so an
+   * existing store is exactly as it was at its last [Checkpoint].
+   */
+  void RestoreCheckpoint();
+
+  /* Makes sure the backing file has room for block [id], growing it by whole
+   * extents of [BLOCKS_PER_EXTENT] blocks. In MMAP mode the new extent is
+   * also mapped, in place, after the existing ones.
+   */
+  void EnsureAllocated(uint32_t id);
+
+  /* Maps the file range of blocks [start, end) over the reserved range.
+   */
+  void MapExtent(uint32_t start, uint32_t end);
+
+  /* Makes the deleted block [id] read as zeros again, like a new one, and
+   * drops whatever of it was not written back.
+   */
+  void ResetBlock(uint32_t id);
+
  public:
-  BlockManager(std::string _name);
+  /* Starts an empty store under ./build/app/[_name], or with [open_existing]
+   * opens the one already there (see [SetNumBlocks]). [_mode] must be the
+   * mode it was created with, except that SINGLE_FILE and MMAP share a
+   * layout.
+   */
+  BlockManager(std::string _name, StorageMode _mode = SINGLE_FILE,
+               uint32_t _blocks_in_memory = DEFAULT_BLOCKS_IN_MEMORY,
+               EvictionPolicyType _policy = LRU_POLICY,
+               bool open_existing = false);
   ~BlockManager();
-  uint32_t CreateBlock();
+
+  /* Returns the id of a new block of zeros: the deleted id closest to
+   * [near], so that related blocks stay close on disk, or the next new id if
+   * there are none.
+   */
+  uint32_t CreateBlock(uint32_t near = 0);
+  uint32_t NumBlocks() { return cur_num_blocks; }
+  uint32_t NumFreeBlocks() { return free_ids.size(); }
+
+  /* Counts since the store was opened: blocks read and written back, opens
+   * that found the block in memory and that had to load it, blocks read
+   * ahead, and undo copies saved (see [Checkpoint]). MMAP stores count none,
+   * the kernel does their I/O. Safe to call alongside anything.
+   */
+  uint64_t NumReads() { return num_reads; }
+  uint64_t NumWrites() { return num_writes; }
+  uint64_t NumHits() { return num_hits; }
+  uint64_t NumMisses() { return num_misses; }
+  uint64_t NumPrefetches() { return num_prefetches; }
+  uint64_t NumUndoSaves() { return num_undo_saves; }
+
+  /* Declares blocks [1, num_blocks] of a reopened store as in use, so they
+   * are read from disk and [CreateBlock] continues after them. Until then
+   * only block 0 can be opened.
+   */
+  void SetNumBlocks(uint32_t num_blocks);
+
+  /* Writes the list of deleted blocks into the first of them, for the owner
+   * to keep with [NumBlocks], and returns the id of its first block (0 if
+   * there are none). Like any block, the list reaches the disk with the next
+   * [Sync], and goes back with a [Checkpoint].
+   */
+  uint32_t SaveFreeList();
+
+  /* Reads back the list of deleted blocks saved starting at block [head] of
+   * a reopened store, after [SetNumBlocks].
+   */
+  void LoadFreeList(uint32_t head);
+
+  /* Writes back every modified block and waits until the files are on disk.
+   * Blocks stay in memory.
+   */
+  void Sync();
+
+  /* [Sync]s and makes the store as it is now the one reopening it restores,
+   * whatever is written after. Until the next checkpoint, the first write
+   * back of each block that existed costs a read and a synced append to an
+   * undo file. Not for MMAP mode.
+   */
+  void Checkpoint();
+
+  /* Frees block [id] for a later [CreateBlock]; its contents are dropped
+   * without being written back. Exits with an error if it is not in use.
+   */
   void DeleteBlock(uint32_t id);
+  // Returns the position of block [id] in [internal_mem]. Not for MMAP mode.
   uint32_t OpenBlock(uint32_t id);
 
-  Block *internal_mem;
+  /* Returns the in-memory copy of block [id], opening it if needed. It stays
+   * in memory, at the same address, until it is released with [UnpinBlock],
+   * whatever other threads open meanwhile. Safe to call from several threads
+   * at once.
+   *
+   * Blocks are pinned once per pin, and only unpinned blocks are evicted, so
+   * the cache must be larger than the number of blocks pinned at once.
+   */
+  Block<BlockSize> *PinBlock(uint32_t id);
+  void UnpinBlock(Block<BlockSize> *block);
+
+  /* Starts reading block [id] into memory in the background, so a later open
+   * does not wait for the disk. Does nothing if it is already in memory or
+   * too many reads are queued. For MMAP the kernel does the read-ahead.
+   */
+  void Prefetch(uint32_t id);
+
+  /* [PinBlock] with the unpin done by the returned handle.
+   */
+  BlockHandle<BlockSize> Pin(uint32_t id) {
+    return BlockHandle<BlockSize>(this, PinBlock(id));
+  }
+
+  /* Tells the kernel how the blocks are about to be accessed. Only affects
+   * MMAP mode.
+   */
+  void Advise(AccessHint _hint);
+  AccessHint GetHint() { return hint; }
+
+  /* Records that the open block [id] was modified, so it is written back when
+   * it is evicted. Clean blocks are dropped without any I/O.
+   */
+  void MarkDirty(uint32_t id);
+
+  Block<BlockSize> *internal_mem;
 };
 
 #endif  // BLOCK_MANAGER_H
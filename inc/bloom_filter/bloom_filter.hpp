@@ -0,0 +1,98 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <vector>
+
+// Filter bits per key, for about 1% false positives
+#define BLOOM_BITS_PER_KEY 10
+
+/* Returns a 64 bit hash of the [size] bytes at [data], mixed well enough that
+ * its two halves can index a [BloomFilter] independently.
+ */
+uint64_t HashBytes(const void *data, size_t size);
+
+/* A Bloom filter over the hashes (see [HashBytes]) of a set of keys: says
+ * whether a key may be in the set, never wrongly that it is not. Sized for
+ * the set when created, so a changed set needs a new filter.
+ */
+class BloomFilter {
+  std::vector<uint64_t> bits;
+  int num_hashes = 0;
+
+ public:
+  /* An empty filter with [BLOOM_BITS_PER_KEY] bits for each of [num_keys],
+   * or no filter at all for the default.
+   */
+  BloomFilter() {}
+  BloomFilter(size_t num_keys);
+
+  bool Empty() const { return bits.empty(); }
+
+  void Add(uint64_t hash);
+
+  /* Return: false if the key with [hash] was never added.
+   */
+  bool MayContain(uint64_t hash) const;
+};
+
+// What the [LeafFilters] say about a key and a block
+enum FilterResult { NO_FILTER, NOT_IN_LEAF, MAYBE_IN_LEAF };
+
+/* The Bloom filters of the leaves of a tree, by block id. Kept in memory
+ * only: a leaf's filter is rebuilt whenever the leaf is written, or read
+ * without one, e.g. after the tree is reopened. A lookup checks the filter of
+ * a leaf before reading it, so most lookups of absent keys stop at the parent.
+ *
+ * Safe to use from many threads at once. Counts the checks to measure the
+ * false positive rate, and prints it when destroyed.
+ */
+class LeafFilters {
+  std::shared_mutex lock;
+  // by block id, which are dense; an [Empty] filter for the blocks without
+  std::vector<BloomFilter> filters;
+  // checks that found a filter, that ruled the key out, and that let a key
+  // through that was not in the leaf
+  std::atomic<int> num_checks, num_negatives, num_false_positives;
+  // the depth of the leaves, as last seen by a lookup
+  std::atomic<int> leaf_depth;
+
+ public:
+  LeafFilters();
+  ~LeafFilters();
+
+  /* Replaces the filter of leaf [id] with [filter].
+   */
+  void Set(uint32_t id, BloomFilter &&filter);
+
+  /* Drops the filter of block [id], which is no longer a leaf.
+   */
+  void Erase(uint32_t id);
+
+  /* Checks [hash] against the filter of block [id]: [NO_FILTER] if it has
+   * none (it is an internal node, or a leaf not read yet).
+   */
+  FilterResult Check(uint32_t id, uint64_t hash);
+
+  /* Records that a key let through by [Check] was not in the leaf.
+   */
+  void CountFalsePositive() { num_false_positives++; }
+
+  /* The depth of the leaves (the root is at 0), so lookups only check the
+   * filters where the children are leaves; 0 until [SetLeafDepth]. Only a
+   * hint: a block without a filter is read either way.
+   */
+  int LeafDepth() { return leaf_depth.load(std::memory_order_relaxed); }
+  void SetLeafDepth(int depth) {
+    leaf_depth.store(depth, std::memory_order_relaxed);
+  }
+
+  int NumChecks() { return num_checks; }
+  int NumNegatives() { return num_negatives; }
+  int NumFalsePositives() { return num_false_positives; }
+};
+
+#endif  // BLOOM_FILTER_H
@@ -0,0 +1,160 @@
+#ifndef EVICTION_POLICY_H
+#define EVICTION_POLICY_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Which blocks a BlockManager drops when it needs room.
+//  - LRU_POLICY: strict least recently used ([LRUCache])
+//  - CLOCK_POLICY: one reference bit per block swept by a clock hand; a hit
+//    only sets the bit
+//  - TWO_Q_POLICY: blocks seen once wait in a FIFO and only blocks hit again
+//    reach the LRU main queue, so one pass over many blocks cannot push out
+//    the hot ones
+//  - ARC_POLICY: adaptive replacement cache, balancing recency and frequency
+//    with the history of recently evicted ids
+enum EvictionPolicyType { LRU_POLICY, CLOCK_POLICY, TWO_Q_POLICY, ARC_POLICY };
+
+// The [evicted_id] of a [EvictionPolicy::Put] that dropped nothing. Not 0,
+// which is a block like any other (a tree's superblock).
+#define NO_EVICTION UINT32_MAX
+
+/* Maps the ids of the blocks in memory to their positions [0, cap), and picks
+ * which block to drop when a new one needs a position.
+ *
+ * Not thread-safe, except that any number of threads may call [Get] at once
+ * as long as nobody calls anything else meanwhile. Policies that reorder on a
+ * hit skip the reordering when another thread is doing it at the same time, so
+ * they are exact single-threaded and close to it under contention.
+ */
+class EvictionPolicy {
+ public:
+  virtual ~EvictionPolicy() {}
+
+  /* Returns the position of [id] and records the hit, or a position >= cap if
+   * it is not in memory.
+   */
+  virtual uint32_t Get(uint32_t id) = 0;
+
+  /* Returns the position of [id] without recording a hit, or a position >=
+   * cap if it is not in memory.
+   */
+  virtual uint32_t Find(uint32_t id) = 0;
+
+  /* Gives [id], which is not in memory, a position. When all positions are in
+   * use, the block the policy drops must pass [evictable] (any block if it is
+   * empty); its id is put in [evicted_id], which is [NO_EVICTION] if nothing
+   * was dropped.
+   * Returns a position >= cap, without adding [id], if no block can be
+   * dropped.
+   */
+  virtual uint32_t Put(
+      uint32_t id, uint32_t *evicted_id,
+      const std::function<bool(uint32_t)> &evictable = nullptr) = 0;
+
+  /* Calls [visit] with the id and position of every block in memory.
+   */
+  virtual void ForEach(
+      const std::function<void(uint32_t, uint32_t)> &visit) = 0;
+};
+
+/* Returns a new [EvictionPolicy] of the given [type] for [cap] blocks.
+ */
+EvictionPolicy *NewEvictionPolicy(EvictionPolicyType type, int cap);
+
+class ClockCache : public EvictionPolicy {
+  int cap, size;
+  // id held by each position, and whether it was hit since the hand passed
+  std::vector<uint32_t> ids;
+  std::unique_ptr<std::atomic<bool>[]> referenced;
+  std::unordered_map<uint32_t, uint32_t> positions;
+  int hand;
+
+ public:
+  ClockCache(int _cap);
+
+  uint32_t Get(uint32_t id);
+  uint32_t Find(uint32_t id);
+  uint32_t Put(uint32_t id, uint32_t *evicted_id,
+               const std::function<bool(uint32_t)> &evictable = nullptr);
+  void ForEach(const std::function<void(uint32_t, uint32_t)> &visit);
+};
+
+/* The full 2Q of Johnson and Shasha: new blocks enter the [A1in] FIFO, ids
+ * dropped from it are remembered in [A1out], and only blocks requested again
+ * while remembered enter the [Am] LRU.
+ */
+class TwoQCache : public EvictionPolicy {
+  struct Entry {
+    uint32_t pos;
+    bool in_am;
+    std::list<uint32_t>::iterator it;
+  };
+
+  int cap, size;
+  // target size of A1in and number of ids A1out remembers
+  int kin, kout;
+  // most recent first
+  std::list<uint32_t> a1in, am, a1out;
+  std::unordered_map<uint32_t, Entry> resident;
+  std::unordered_map<uint32_t, std::list<uint32_t>::iterator> ghosts;
+  std::mutex touch_lock;
+
+  // Returns the least recently used block of [queue] that passes
+  // [evictable], or nullptr
+  const uint32_t *Victim(const std::list<uint32_t> &queue,
+                         const std::function<bool(uint32_t)> &evictable);
+
+ public:
+  TwoQCache(int _cap);
+
+  uint32_t Get(uint32_t id);
+  uint32_t Find(uint32_t id);
+  uint32_t Put(uint32_t id, uint32_t *evicted_id,
+               const std::function<bool(uint32_t)> &evictable = nullptr);
+  void ForEach(const std::function<void(uint32_t, uint32_t)> &visit);
+};
+
+/* ARC of Megiddo and Modha: [t1] holds blocks seen once recently and [t2]
+ * blocks seen at least twice, [b1]/[b2] remember the ids recently dropped from
+ * each, and a hit on a remembered id moves the target size [p] of [t1]
+ * towards the list that would have kept it.
+ */
+class ARCCache : public EvictionPolicy {
+  struct Entry {
+    uint32_t pos;
+    bool in_t2;
+    std::list<uint32_t>::iterator it;
+  };
+
+  int cap, size;
+  double p;
+  // most recent first
+  std::list<uint32_t> t1, t2, b1, b2;
+  std::unordered_map<uint32_t, Entry> resident;
+  // whether each remembered id is in [b2] (else [b1]), and where
+  std::unordered_map<uint32_t, std::pair<bool, std::list<uint32_t>::iterator> >
+      ghosts;
+  std::mutex touch_lock;
+
+  const uint32_t *Victim(const std::list<uint32_t> &list,
+                         const std::function<bool(uint32_t)> &evictable);
+  void Forget(std::list<uint32_t> &ghost_list);
+
+ public:
+  ARCCache(int _cap);
+
+  uint32_t Get(uint32_t id);
+  uint32_t Find(uint32_t id);
+  uint32_t Put(uint32_t id, uint32_t *evicted_id,
+               const std::function<bool(uint32_t)> &evictable = nullptr);
+  void ForEach(const std::function<void(uint32_t, uint32_t)> &visit);
+};
+
+#endif  // EVICTION_POLICY_H
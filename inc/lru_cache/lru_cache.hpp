@@ -2,6 +2,9 @@
 #define LRUCache_H
 
 #include <cstdint>
+#include <eviction_policy/eviction_policy.hpp>
+#include <functional>
+#include <mutex>
 #include <unordered_map>
 
 class LRUNode {
@@ -21,24 +24,29 @@ class LRULinkedList {
 
   LRUNode *AddNodeToHead(uint32_t id, uint32_t pos);
   void MoveNodeToHead(LRUNode *node);
+  void RemoveNode(LRUNode *node);
   void RemoveRearNode();
   LRUNode *GetRearNode();
+  // Returns the next more recently used node, or nullptr at the head
+  LRUNode *GetPrevNode(LRUNode *node);
 };
 
-class LRUCache {
+class LRUCache : public EvictionPolicy {
   int cap, size;
   LRULinkedList *node_list;
   std::unordered_map<uint32_t, LRUNode *> node_hash;
+  // serializes the moves to the head of the list done by [Get]
+  std::mutex touch_lock;
 
  public:
   LRUCache(int _cap);
   ~LRUCache();
 
   uint32_t Get(uint32_t id);
-  uint32_t Put(uint32_t id, uint32_t *evicted_id);
-
-  std::unordered_map<uint32_t, LRUNode *>::iterator GetBegin();
-  std::unordered_map<uint32_t, LRUNode *>::iterator GetEnd();
+  uint32_t Find(uint32_t id);
+  uint32_t Put(uint32_t id, uint32_t *evicted_id,
+               const std::function<bool(uint32_t)> &evictable = nullptr);
+  void ForEach(const std::function<void(uint32_t, uint32_t)> &visit);
 };
 
 #endif  // LRUCache_H
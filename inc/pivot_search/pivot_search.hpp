@@ -0,0 +1,60 @@
+#ifndef PIVOT_SEARCH_H
+#define PIVOT_SEARCH_H
+
+#include <cstdint>
+
+// The vector kernel is picked at build time from the target flags (see the
+// SIMD option in the Makefile); defining PIVOT_SEARCH_SCALAR forces the
+// portable version.
+#if !defined(PIVOT_SEARCH_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#define PIVOT_SEARCH_AVX2
+#elif !defined(PIVOT_SEARCH_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define PIVOT_SEARCH_SSE2
+#endif
+
+/* Returns the number of the [size] sorted [keys] that are <= [key], i.e. the
+ * index of the child [key] belongs to. Branch-free: every key is compared and
+ * the results are summed.
+ */
+inline int UpperBoundIndexScalar(const uint32_t *keys, int size, uint32_t key) {
+  int count = 0;
+  for (int i = 0; i < size; ++i) count += keys[i] <= key;
+  return count;
+}
+
+/* Same as [UpperBoundIndexScalar], comparing 8 (AVX2) or 4 (SSE2) keys at a
+ * time and counting the matches with a movemask + popcount.
+ */
+inline int UpperBoundIndex(const uint32_t *keys, int size, uint32_t key) {
+  int i = 0;
+  int count = 0;
+#if defined(PIVOT_SEARCH_AVX2) || defined(PIVOT_SEARCH_SSE2)
+  // there is no unsigned compare, so flip the sign bits and compare signed
+  const int32_t flip = (int32_t)0x80000000;
+  int32_t flipped_key = (int32_t)(key ^ 0x80000000u);
+#endif
+#if defined(PIVOT_SEARCH_AVX2)
+  const __m256i flip8 = _mm256_set1_epi32(flip);
+  const __m256i key8 = _mm256_set1_epi32(flipped_key);
+  for (; i + 8 <= size; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+    __m256i gt = _mm256_cmpgt_epi32(_mm256_xor_si256(v, flip8), key8);
+    count += 8 - __builtin_popcount(
+                     _mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+  }
+#endif
+#if defined(PIVOT_SEARCH_AVX2) || defined(PIVOT_SEARCH_SSE2)
+  const __m128i flip4 = _mm_set1_epi32(flip);
+  const __m128i key4 = _mm_set1_epi32(flipped_key);
+  for (; i + 4 <= size; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+    __m128i gt = _mm_cmpgt_epi32(_mm_xor_si128(v, flip4), key4);
+    count += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(gt)));
+  }
+#endif
+  return count + UpperBoundIndexScalar(keys + i, size - i, key);
+}
+
+#endif  // PIVOT_SEARCH_H
@@ -3,10 +3,12 @@
 
 #include <block_manager/block_manager.hpp>
 
+template <uint32_t BlockSize>
 class Serializable {
  public:
-  virtual int Serialize(Block *disk_store, int pos) = 0;
-  virtual void Deserialize(const Block &disk_store) = 0;
+  virtual ~Serializable() {}
+  virtual int Serialize(Block<BlockSize> *disk_store, int pos) = 0;
+  virtual void Deserialize(const Block<BlockSize> &disk_store) = 0;
 };
 
 #endif
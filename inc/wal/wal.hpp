@@ -0,0 +1,79 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Receives the records of a log in the order they were appended
+typedef std::function<void(const char *record, uint32_t size)> RecordVisitor;
+
+/* An append-only log of opaque records, made durable with group commit: the
+ * records appended by many writers while one sync is running are all written
+ * and synced together by the next.
+ *
+ * Each record is stored as | size | checksum | bytes |, so a record torn by a
+ * crash ends the log on replay instead of being returned.
+ *
+ * [Append] and [Commit] may be called from many threads at once.
+ */
+class WriteAheadLog {
+  int fd;
+  std::mutex lock;
+  std::condition_variable synced;
+  // records appended since the last write, in file format
+  std::vector<char> pending;
+  // sequence number of the last record appended and of the last one synced
+  uint64_t last_lsn, synced_lsn;
+  // whether a writer is writing and syncing [pending] on everyone's behalf
+  bool syncing;
+  // bytes in the file and in [pending]
+  size_t size;
+  int num_syncs, num_commits;
+  // bytes written to the file since it was opened
+  uint64_t num_bytes_written;
+
+ public:
+  /* Opens the log at [filename], creating it if it does not exist. Existing
+   * records are kept for [Replay].
+   */
+  WriteAheadLog(std::string filename);
+  ~WriteAheadLog();
+
+  /* Adds the [size] bytes at [record] to the end of the log, in memory.
+   * Return: The sequence number to [Commit].
+   */
+  uint64_t Append(const void *record, uint32_t size);
+
+  /* Returns once the record [lsn], and every one before it, is on disk.
+   * Either syncs all the records appended so far or waits for the sync of
+   * another writer that covers [lsn].
+   */
+  void Commit(uint64_t lsn);
+
+  /* Calls [visit] on every whole record in the file, oldest first. Only for
+   * recovery, before anything is appended.
+   */
+  void Replay(const RecordVisitor &visit);
+
+  /* Drops every record, once whatever they recorded is safely elsewhere.
+   * Pending commits return without syncing. Until the next sync the dropped
+   * records may come back after a crash, so [Replay] callers must be able to
+   * recognize records they already applied.
+   */
+  void Truncate();
+
+  /* Returns the bytes appended since the last [Truncate].
+   */
+  size_t Size();
+
+  /* Returns the bytes written to the file since it was opened, headers
+   * included.
+   */
+  uint64_t BytesWritten();
+};
+
+#endif  // WAL_H
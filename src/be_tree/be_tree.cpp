@@ -1,11 +1,13 @@
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdarg>
 #include <iostream>
 #include <utility>
 #include <vector>
 
 #include <be_tree/be_tree.hpp>
+#include <pivot_search/pivot_search.hpp>
 
 #include <map>
 #include <set>
@@ -28,12 +30,13 @@ static void rtassert(bool cond, const char *const format...) {
   va_list args;
   va_start(args, format);
   if (!cond) {
-    fprintf(stderr, format, args);
+    vfprintf(stderr, format, args);
     exit(1);
   }
+  va_end(args);
 }
 
-void PrintUpsert(BeUpsert const &ups) {
+void PrintUpsert(BeUpsert<uint32_t, uint32_t> const &ups) {
   std::cerr << "key:" << ups.key << std::endl;
   std::cerr << "param: " << ups.parameter << std::endl;
   std::cerr << "ts: " << ups.timestamp << std::endl;
@@ -49,6 +52,12 @@ void PrintUpsert(BeUpsert const &ups) {
     case UPDATE:
       type = "update";
       break;
+    case MERGE:
+      type = "merge";
+      break;
+    case DELETE_RANGE:
+      type = "delete range to " + std::to_string(ups.end_key);
+      break;
     default:
       type = "invalid";
       break;
@@ -56,53 +65,290 @@ void PrintUpsert(BeUpsert const &ups) {
   std::cerr << type << std::endl;
 }
 
-bool SortBeUpsert(BeUpsert const &lhs, BeUpsert const &rhs) {
-  return lhs.timestamp > rhs.timestamp;
+void BeHistogram::Add(uint64_t value) {
+  int bucket = 0;
+  while (bucket + 1 < NUM_BUCKETS && value >> (bucket + 1)) ++bucket;
+  buckets[bucket]++;
+  count++;
+  sum += value;
+  max = std::max(max, value);
+}
+
+uint64_t BeHistogram::Percentile(double percent) const {
+  if (count == 0) return 0;
+  // the rank of the value, counting from 1
+  uint64_t rank = std::max<uint64_t>(1, ceil(count * percent / 100));
+  uint64_t seen = 0;
+  for (int i = 0; i + 1 < NUM_BUCKETS; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) return std::min<uint64_t>(max, (2ull << i) - 1);
+  }
+  return max;
+}
+
+template <class Compare, class Key>
+static bool KeysEqual(const Key &lhs, const Key &rhs) {
+  return !Compare()(lhs, rhs) && !Compare()(rhs, lhs);
+}
+
+// key-only comparisons for searching buffers sorted by [SortBeUpsertByKey]
+template <class Compare, class Key, class Value>
+static bool UpsertKeyLess(BeUpsert<Key, Value> const &lhs, const Key &key) {
+  return Compare()(lhs.key, key);
+}
+template <class Compare, class Key, class Value>
+static bool KeyUpsertLess(const Key &key, BeUpsert<Key, Value> const &rhs) {
+  return Compare()(key, rhs.key);
+}
+
+// For error messages: the key itself if it is a number, else its bytes in hex
+template <class Key>
+static std::string KeyString(const Key &key) {
+  if constexpr (std::is_arithmetic<Key>::value) {
+    return std::to_string(key);
+  } else {
+    std::string res = "0x";
+    const unsigned char *bytes = (const unsigned char *)&key;
+    for (size_t i = 0; i < sizeof(Key); ++i) {
+      res += "0123456789abcdef"[bytes[i] >> 4];
+      res += "0123456789abcdef"[bytes[i] & 0xf];
+    }
+    return res;
+  }
+}
+
+// Varints of packed leaves: 7 bits per byte, low bits first, the high bit set
+// on every byte but the last
+static int VarintSize(uint32_t v) {
+  int size = 1;
+  for (; v >= 0x80; v >>= 7) ++size;
+  return size;
 }
 
+static unsigned char *PutVarint(unsigned char *out, uint32_t v) {
+  for (; v >= 0x80; v >>= 7) *out++ = (v & 0x7f) | 0x80;
+  *out++ = v;
+  return out;
+}
+
+static const unsigned char *GetVarint(const unsigned char *in, uint32_t &v) {
+  v = 0;
+  for (int shift = 0;; shift += 7) {
+    unsigned char byte = *in++;
+    v |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return in;
+  }
+}
+
+// Bytes the pair [key]/[value] takes in a packed leaf after [prev_key]
+static int PackedPairSize(uint32_t prev_key, uint32_t key, uint32_t value) {
+  return VarintSize(key - prev_key) + VarintSize(value);
+}
+
+// Bytes of keys and values the user passes in for an upsert of [type]
+template <class Key, class Value>
+static uint64_t UserBytes(UpsertFunction type) {
+  if (type == DELETE) return sizeof(Key);
+  if (type == DELETE_RANGE) return 2 * sizeof(Key);
+  return sizeof(Key) + sizeof(Value);
+}
+
+// the template parameters shared by every member definition below
+#define BE_TEMPLATE                                                 \
+  template <uint32_t BlockSize, uint32_t EpsilonPercent, class Key, \
+            class Value, class Compare>
+#define BE_NODE BeNode<BlockSize, EpsilonPercent, Key, Value, Compare>
+#define BE_TREE BeTree<BlockSize, EpsilonPercent, Key, Value, Compare>
+
 // noop because we work directly off the Block
-int BeNode::Serialize(Block *disk_store, int pos) { return 0; }
+BE_TEMPLATE
+int BE_NODE::Serialize(Block<BlockSize> *disk_store, int pos) {
+  return 0;
+}
 
 ///////////////////////////////////////////////////////////////
 // BeNode implementation
 ///////////////////////////////////////////////////////////////
-BeNode::BeNode(BlockManager *_bmanager, uint32_t _id)
+BE_TEMPLATE
+BE_NODE::BeNode(BlockManager<BlockSize> *_bmanager, uint32_t _id,
+                const MergeOperator *_merge_op, LeafFilters *_filters,
+                BeStats *_stats)
     : bmanager(_bmanager),
       id(_id),
-      parent(nullptr),
+      merge_op(_merge_op),
+      filters(_filters),
+      stats(_stats),
       is_leaf(nullptr),
       buffer(nullptr),
       pivots(nullptr),
-      data(nullptr) {
+      data(nullptr),
+      packed(nullptr) {
   Open();
 }
 
-void BeNode::Deserialize(const Block &disk_store) {
-  parent = (uint32_t *)(disk_store.block_buf);
-  is_leaf = parent + 1;
-  data = (struct BeData *)(disk_store.block_buf + 2 * sizeof(uint32_t));
-  buffer = (struct BeBuffer *)(disk_store.block_buf + 2 * sizeof(uint32_t));
-  pivots = (struct BePivots *)(disk_store.block_buf + 2 * sizeof(uint32_t) +
-                               sizeof(struct BeBuffer));
+BE_TEMPLATE
+void BE_NODE::Deserialize(const Block<BlockSize> &disk_store) {
+  static_assert(sizeof(struct BeData<Geometry>) <= Geometry::DATA_SIZE &&
+                    sizeof(struct BePackedData<Geometry>) <=
+                        Geometry::DATA_SIZE &&
+                    sizeof(struct BeBuffer<Geometry>) +
+                            sizeof(struct BePivots<Geometry>) <=
+                        Geometry::DATA_SIZE,
+                "node layout overflows the block");
+  is_leaf = (uint32_t *)(disk_store.block_buf);
+  const unsigned char *node_data =
+      disk_store.block_buf + Geometry::HEADER_SIZE;
+  data = (struct BeData<Geometry> *)node_data;
+  packed = (struct BePackedData<Geometry> *)node_data;
+  buffer = (struct BeBuffer<Geometry> *)node_data;
+  pivots = (struct BePivots<Geometry> *)(node_data +
+                                         sizeof(struct BeBuffer<Geometry>));
 }
 
-void BeNode::Open() {
-  // make sure the current block is open
-  Deserialize(bmanager->internal_mem[bmanager->OpenBlock(id)]);
+BE_TEMPLATE
+void BE_NODE::Open() {
+  // unpin the block we leave first, so a query walking down the tree never
+  // holds two and readers cannot pin every frame between them
+  handle.Release();
+  handle = bmanager->Pin(id);
+  Deserialize(*handle.Get());
 }
 
-// TODO: binary search
-int BeNode::IndexOfKey(uint32_t key) {
+BE_TEMPLATE
+void BE_NODE::MarkDirty() { bmanager->MarkDirty(id); }
+
+BE_TEMPLATE
+int BE_NODE::IndexOfKey(const Key &key) {
   assert(!*is_leaf);
-  Open();
 
-  for (int i = 0; i <= pivots->size; ++i) {
-    if ((i == pivots->size || key < pivots->pivots[i]) &&
-        (i == 0 || key >= pivots->pivots[i - 1]))
-      return i;
+  if constexpr (UINT32_KEYS) {
+    return UpperBoundIndex(pivots->pivots, pivots->size, key);
+  } else {
+    return std::upper_bound(pivots->pivots, pivots->pivots + pivots->size, key,
+                            Compare()) -
+           pivots->pivots;
   }
 }
 
+BE_TEMPLATE
+void BE_NODE::ReadLeaf(std::vector<Key> &keys, std::vector<Value> &values) {
+  assert(*is_leaf);
+
+  if (*is_leaf != PACKED_LEAF) {
+    keys.assign(data->keys, data->keys + data->size);
+    values.assign(data->values, data->values + data->size);
+    return;
+  }
+  // only [PACKABLE] trees have packed leaves, see the [BeTree] constructor
+  if constexpr (PACKABLE) {
+    keys.resize(packed->size);
+    values.resize(packed->size);
+    const unsigned char *k = packed->bytes;
+    const unsigned char *v = packed->bytes + packed->key_bytes;
+    uint32_t key = 0;
+    for (uint32_t i = 0; i < packed->size; ++i) {
+      uint32_t delta;
+      k = GetVarint(k, delta);
+      key += delta;
+      keys[i] = key;
+      v = GetVarint(v, values[i]);
+    }
+  }
+}
+
+BE_TEMPLATE
+int BE_NODE::ViewLeaf(std::vector<Key> &packed_keys,
+                      std::vector<Value> &packed_values, const Key *&keys,
+                      const Value *&values) {
+  assert(*is_leaf);
+
+  if (*is_leaf != PACKED_LEAF) {
+    keys = data->keys;
+    values = data->values;
+    return data->size;
+  }
+  ReadLeaf(packed_keys, packed_values);
+  keys = packed_keys.data();
+  values = packed_values.data();
+  return packed_keys.size();
+}
+
+BE_TEMPLATE
+bool BE_NODE::WriteLeaf(const Key keys[], const Value values[], int size) {
+  assert(*is_leaf);
+
+  if (*is_leaf != PACKED_LEAF) {
+    if (size > NUM_DATA_PAIRS) return false;
+    memmove(data->keys, keys, size * sizeof(Key));
+    memmove(data->values, values, size * sizeof(Value));
+    data->size = size;
+    MarkDirty();
+    SetFilter(keys, size);
+    return true;
+  }
+
+  if constexpr (PACKABLE) {
+    int key_bytes = 0, value_bytes = 0;
+    for (int i = 0; i < size; ++i) {
+      key_bytes += VarintSize(keys[i] - (i > 0 ? keys[i - 1] : 0));
+      value_bytes += VarintSize(values[i]);
+    }
+    if (key_bytes + value_bytes > PACKED_BYTES) return false;
+    unsigned char *k = packed->bytes;
+    unsigned char *v = packed->bytes + key_bytes;
+    for (int i = 0; i < size; ++i) {
+      k = PutVarint(k, keys[i] - (i > 0 ? keys[i - 1] : 0));
+      v = PutVarint(v, values[i]);
+    }
+    packed->size = size;
+    packed->key_bytes = key_bytes;
+    MarkDirty();
+    SetFilter(keys, size);
+  }
+  return true;
+}
+
+BE_TEMPLATE
+void BE_NODE::SetFilter(const Key keys[], int size) {
+  if (!filters) return;
+  BloomFilter filter(size);
+  for (int i = 0; i < size; ++i) filter.Add(HashBytes(&keys[i], sizeof(Key)));
+  filters->Set(id, std::move(filter));
+}
+
+BE_TEMPLATE
+bool BE_NODE::FindInLeaf(const Key &key, Value &value) {
+  assert(*is_leaf);
+
+  if (*is_leaf != PACKED_LEAF) {
+    int i = std::lower_bound(data->keys, data->keys + data->size, key,
+                             Compare()) -
+            data->keys;
+    if (i == data->size || Compare()(key, data->keys[i])) return false;
+    value = data->values[i];
+    return true;
+  }
+
+  if constexpr (PACKABLE) {
+    const unsigned char *k = packed->bytes;
+    uint32_t cur = 0;
+    uint32_t i = 0;
+    for (; i < packed->size; ++i) {
+      uint32_t delta;
+      k = GetVarint(k, delta);
+      cur += delta;
+      if (cur >= key) break;
+    }
+    if (i == packed->size || cur != key) return false;
+    // skip the values of the keys before it, each ends on a byte below 0x80
+    const unsigned char *v = packed->bytes + packed->key_bytes;
+    for (uint32_t skipped = 0; skipped < i; ++v)
+      if (!(*v & 0x80)) ++skipped;
+    GetVarint(v, value);
+  }
+  return true;
+}
+
 std::set<uint32_t> seen_keys;
 void CheckKeys() {
   for (uint32_t i = 1u; i <= 20000u; i++) {
@@ -113,98 +359,161 @@ void CheckKeys() {
   }
 }
 
-bool BeNode::UpsertLeaf(struct BeUpsert upsert[], int &num) {
+BE_TEMPLATE
+bool BE_NODE::UpsertLeaf(BeUpsert<Key, Value> upsert[], int num,
+                         Key &split_key, uint32_t &new_id) {
   assert(*is_leaf);
-  while (num > 0) {
-    num--;
-    // find the index of the key
-    int index = -1;
-    for (int j = 0; j < data->size; ++j) {
-      if (data->keys[j] == upsert[num].key) {
-        index = j;
-        break;
-      }
-    }
+
+  // merge the upserts with the existing pairs, read in place from a plain
+  // leaf. A flush batch comes from a single buffer, so the result of a plain
+  // leaf fits on the stack; packed leaves hold more pairs and use the heap.
+  std::vector<Key> packed_keys, packed_out_keys;
+  std::vector<Value> packed_values, packed_out_values;
+  const Key *old_keys;
+  const Value *old_values;
+  int old_size = ViewLeaf(packed_keys, packed_values, old_keys, old_values);
+  Key plain_keys[NUM_DATA_PAIRS + NUM_UPSERTS];
+  Value plain_values[NUM_DATA_PAIRS + NUM_UPSERTS];
+  Key *keys = plain_keys;
+  Value *values = plain_values;
+  if (*is_leaf == PACKED_LEAF) {
+    packed_out_keys.resize(old_size + num);
+    packed_out_values.resize(old_size + num);
+    keys = packed_out_keys.data();
+    values = packed_out_values.data();
+  }
+  int size = 0;
+  int d = 0;
+  int u = 0;
+  // the pairs below the end of the DELETE_RANGEs seen so far are deleted
+  bool deleting = false;
+  Key delete_end = Key();
+  // copies the pairs before [run_end] over, skipping the deleted ones in bulk
+  auto copy_run = [&](int run_end) {
+    if (deleting)
+      d = std::max(d, (int)(std::lower_bound(old_keys + d, old_keys + run_end,
+                                             delete_end, Compare()) -
+                            old_keys));
+    memcpy(keys + size, old_keys + d, (run_end - d) * sizeof(Key));
+    memcpy(values + size, old_values + d, (run_end - d) * sizeof(Value));
+    size += run_end - d;
+    d = run_end;
+  };
+  while (u < num) {
+    Key key = upsert[u].key;
+
+    // copy over the untouched run of pairs before the key
+    copy_run(std::lower_bound(old_keys + d, old_keys + old_size, key,
+                              Compare()) -
+             old_keys);
+
+    bool present = d < old_size && KeysEqual<Compare>(old_keys[d], key);
+    Value value = present ? old_values[d++] : Value();
+    if (deleting && Compare()(key, delete_end)) present = false;
 
 #ifndef NDEBUG
-    seen_keys.insert((uint32_t)upsert[num].key);
+    if constexpr (std::is_same<Key, uint32_t>::value) seen_keys.insert(key);
 #endif
-    // deal with upsert
-    switch (upsert[num].type) {
-      case INSERT:
-        rtassert(index < 0, "inserting an existing key: %u\n", upsert[num].key);
-        data->keys[data->size] = upsert[num].key;
-        data->values[data->size] = upsert[num].parameter;
-        data->size++;
-        if (data->size == NUM_DATA_PAIRS) {
-          return true;
-        }
-        break;
-      case UPDATE:
-        rtassert(index >= 0, "updating a nonexistent key: %u\n",
-                 upsert[num].key);
-        data->values[index] = upsert[num].parameter;
-        break;
-      case DELETE:
-        rtassert(index >= 0, "deleting a nonexistent key: %u\n",
-                 upsert[num].key);
-        for (int j = index + 1; j < data->size; ++j) {
-          data->keys[j - 1] = data->keys[j];
-          data->values[j - 1] = data->values[j];
-        }
-        --data->size;
-        break;
-      default:
-        rtassert(false, "invalid upsert type: %u\n", upsert[num].type);
+    // deal with the upserts for the key, oldest first
+    for (; u < num && KeysEqual<Compare>(upsert[u].key, key); ++u) {
+      switch (upsert[u].type) {
+        case INSERT:
+          if (present)
+            rtassert(false, "inserting an existing key: %s\n",
+                     KeyString(key).c_str());
+          present = true;
+          value = upsert[u].parameter;
+          break;
+        case UPDATE:
+          if (!present)
+            rtassert(false, "updating a nonexistent key: %s\n",
+                     KeyString(key).c_str());
+          value = upsert[u].parameter;
+          break;
+        case DELETE:
+          // may be absent: a DELETE replaces an older MERGE (see [Coalesce])
+          present = false;
+          break;
+        case MERGE:
+          value = ApplyMerge(present ? &value : nullptr, upsert[u].parameter);
+          present = true;
+          break;
+        case DELETE_RANGE:
+          present = false;
+          if (!deleting || Compare()(delete_end, upsert[u].end_key))
+            delete_end = upsert[u].end_key;
+          deleting = true;
+          break;
+        default:
+          rtassert(false, "invalid upsert type: %u\n", upsert[u].type);
+      }
+    }
+    if (present) {
+      keys[size] = key;
+      values[size] = value;
+      size++;
     }
   }
-  return false;
+  copy_run(old_size);
+
+  if (WriteLeaf(keys, values, size)) return false;
+  split_key = SplitLeaf(keys, values, size, new_id);
+  return true;
 }
 
-uint32_t BeNode::SplitLeaf(uint32_t &new_id) {
+BE_TEMPLATE
+int BE_NODE::HalfOf(const Key keys[], const Value values[], int size) {
   assert(*is_leaf);
-  Open();
 
-  new_id = bmanager->CreateBlock();
-  BeNode new_sibling(bmanager, new_id);
-  *new_sibling.parent = *parent;
-  *new_sibling.is_leaf = *is_leaf;
+  int half = size / 2;
+  if constexpr (PACKABLE) {
+    if (*is_leaf == PACKED_LEAF) {
+      // the first pair past half of the bytes, keeping a pair on each side
+      int total = 0;
+      for (int i = 0; i < size; ++i)
+        total += PackedPairSize(i > 0 ? keys[i - 1] : 0, keys[i], values[i]);
+      int bytes = 0;
+      for (half = 0; half < size - 1 && 2 * bytes < total; ++half)
+        bytes += PackedPairSize(half > 0 ? keys[half - 1] : 0, keys[half],
+                                values[half]);
+      half = std::max(half, 1);
+    }
+  }
+  return half;
+}
 
-  DebugPrint("SplitLeaf",
-             std::to_string(*parent) + "<-" + std::to_string(new_id));
+BE_TEMPLATE
+Key BE_NODE::SplitLeaf(const Key keys[], const Value values[], int size,
+                       uint32_t &new_id) {
+  assert(*is_leaf);
 
-  // Sort the data in place in the node
-  std::vector<std::pair<uint32_t, uint32_t> > pairs(data->size);
-  for (int i = 0; i < data->size; i++) {
-    pairs[i].first = data->keys[i];
-    pairs[i].second = data->values[i];
-  }
-  std::sort(pairs.begin(), pairs.end());
-  for (int i = 0; i < data->size; i++) {
-    data->keys[i] = pairs[i].first;
-    data->values[i] = pairs[i].second;
-  }
+  // keep the lower half here
+  int half = HalfOf(keys, values, size);
+  bool fits = WriteLeaf(keys, values, half);
+  assert(fits);
 
-  // Move the data pairs over
-  for (int i = data->size / 2; i < data->size; ++i) {
-    new_sibling.data->keys[i - data->size / 2] = data->keys[i];
-    new_sibling.data->values[i - data->size / 2] = data->values[i];
-    new_sibling.data->size++;
-  }
-  // Update the size of the old (left) node
-  data->size -= new_sibling.data->size;
+  new_id = bmanager->CreateBlock(id);
+  BeNode new_sibling(bmanager, new_id, merge_op, filters, stats);
+  if (stats) stats->leaf_splits++;
+  *new_sibling.is_leaf = *is_leaf;
+
+  DebugPrint("SplitLeaf", std::to_string(id) + "->" + std::to_string(new_id));
 
-  return new_sibling.data->keys[0];  // the upper half of the split
+  // Move the upper half over
+  fits = new_sibling.WriteLeaf(keys + half, values + half, size - half);
+  assert(fits);
+
+  return keys[half];  // the upper half of the split
 }
 
-void BeNode::PrintInternal() {
-  Open();
+BE_TEMPLATE
+void BE_NODE::PrintInternal() {
   assert(!*is_leaf);
   std::cerr << std::endl;
   std::cerr << "Node " << id << std::endl;
   std::cerr << "# Pivots: " << pivots->size << std::endl;
   for (int i = 0; i < pivots->size; i++) {
-    std::cerr << pivots->pivots[i] << " ";
+    std::cerr << KeyString(pivots->pivots[i]) << " ";
   }
   std::cerr << std::endl;
   for (int i = 0; i <= pivots->size; i++) {
@@ -213,403 +522,1372 @@ void BeNode::PrintInternal() {
   std::cerr << std::endl;
 }
 
-uint32_t BeNode::SplitInternal(uint32_t &new_id) {
-  Open();
+BE_TEMPLATE
+Key BE_NODE::SplitInternal(uint32_t &new_id) {
   assert(!*is_leaf);
   assert(pivots->size == NUM_PIVOTS);
 
   // create a new block
-  new_id = bmanager->CreateBlock();
-  BeNode new_node(bmanager, new_id);
+  new_id = bmanager->CreateBlock(id);
+  BeNode new_node(bmanager, new_id, merge_op, filters, stats);
+  if (stats) stats->internal_splits++;
   *new_node.is_leaf = *is_leaf;
-  *new_node.parent = *parent;
 
   DebugPrint("SplitInternal",
-             std::to_string(*parent) + "<-" + std::to_string(new_id));
+             std::to_string(id) + "->" + std::to_string(new_id));
 
   // move pivots/pointers over to the new node
-  BeNode moving_node(bmanager, new_id);
   int start_index = (pivots->size + 1) / 2;
-  for (int i = start_index; i <= pivots->size; ++i) {
-    Open();
-    new_node.Open();
-
-    // move the pivots over
-    if (i < pivots->size) {  // there is one more pointer than pivot
-      new_node.pivots->pivots[i - start_index] = pivots->pivots[i];
-      new_node.pivots->size++;
-    }
-    new_node.pivots->pointers[i - start_index] = pivots->pointers[i];
-
-    // change their parent pointers
-    moving_node.SetId(pivots->pointers[i]);
-    *moving_node.parent = new_node.id;
+  int num_moved = pivots->size + 1 - start_index;
+  new_node.pivots->size = num_moved - 1;
+  memcpy(new_node.pivots->pivots, pivots->pivots + start_index,
+         (num_moved - 1) * sizeof(Key));
+  memcpy(new_node.pivots->pointers, pivots->pointers + start_index,
+         num_moved * sizeof(uint32_t));
+
+  // move the upserts of the moved children over, they are the end of the
+  // buffer
+  int moved_start = GroupStart(start_index);
+  new_node.buffer->size = buffer->size - moved_start;
+  memcpy(new_node.buffer->buffer, buffer->buffer + moved_start,
+         new_node.buffer->size * sizeof(BeUpsert<Key, Value>));
+  memcpy(new_node.buffer->counts, buffer->counts + start_index,
+         num_moved * sizeof(uint16_t));
+  memset(buffer->counts + start_index, 0, num_moved * sizeof(uint16_t));
+  buffer->size = moved_start;
+  new_node.buffer->num_ranges = 0;
+  for (int i = 0; buffer->num_ranges > 0 && i < new_node.buffer->size; ++i) {
+    if (new_node.buffer->buffer[i].type != DELETE_RANGE) continue;
+    new_node.buffer->num_ranges++;
+    buffer->num_ranges--;
   }
 
   // reset size of old (left) node (drop the middle pivot entirely)
-  pivots->size -= (new_node.pivots->size + 1);
-  uint32_t split_key =
+  pivots->size = start_index - 1;
+  Key split_key =
       pivots->pivots[pivots->size];  // the middle pivot is the split key
+  MarkDirty();
+  new_node.MarkDirty();
+
+  return split_key;  // the upper half of the split
+}
+
+BE_TEMPLATE
+int BE_NODE::FillPercent() {
+  if (!*is_leaf) return (pivots->size + 1) * 100 / NUM_CHILDREN;
+  if (*is_leaf != PACKED_LEAF) return data->size * 100 / NUM_DATA_PAIRS;
+  // the keys, then the values, each ending on a byte below 0x80
+  const unsigned char *v = packed->bytes + packed->key_bytes;
+  for (uint32_t ended = 0; ended < packed->size; ++v)
+    if (!(*v & 0x80)) ++ended;
+  return (v - packed->bytes) * 100 / PACKED_BYTES;
+}
 
-  // move regular upserts over to new node
-  for (int i = 0; i < buffer->size - buffer->flush_size; i++) {
-    if (buffer->buffer[i].key >= split_key) {
-      new_node.buffer->buffer[new_node.buffer->size] = buffer->buffer[i];
-      new_node.buffer->size++;
-      buffer->buffer[i].type = INVALID;
+BE_TEMPLATE
+void BE_NODE::MergeChildren(int child_index) {
+  assert(!*is_leaf);
+  assert(child_index < pivots->size);
+
+  Key separator = pivots->pivots[child_index];
+  BeNode left(bmanager, pivots->pointers[child_index], merge_op, filters,
+              stats);
+  BeNode right(bmanager, pivots->pointers[child_index + 1], merge_op,
+               filters, stats);
+  uint32_t right_id = right.GetId();
+  DebugPrint("MergeChildren", std::to_string(left.GetId()) + "<-" +
+                                  std::to_string(right_id));
+
+  // internal nodes that fit in one flush until their upserts do too
+  Key split_key;
+  uint32_t new_id;
+  while (!*left.is_leaf &&
+         left.FillPercent() + right.FillPercent() <= MERGE_UP_TO_PERCENT &&
+         left.buffer->size + right.buffer->size > NUM_UPSERTS) {
+    BeNode &fuller =
+        left.buffer->size >= right.buffer->size ? left : right;
+    if (fuller.FlushOneLevel(split_key, new_id) == SPLIT) {
+      AddPivot(split_key, new_id);
+      return;
     }
   }
-  // move flush buffer
-  if (buffer->buffer[buffer->size - buffer->flush_size].key >= split_key) {
-    for (int i = buffer->size - buffer->flush_size; i < buffer->size; i++) {
-      new_node.buffer->buffer[new_node.buffer->size] = buffer->buffer[i];
-      new_node.buffer->size++;
-      buffer->buffer[i].type = INVALID;
+
+  // a single child with the upserts of both, until the pivot is put back
+  buffer->counts[child_index] += buffer->counts[child_index + 1];
+  for (int j = child_index + 1; j < pivots->size; ++j) {
+    pivots->pivots[j - 1] = pivots->pivots[j];
+    pivots->pointers[j] = pivots->pointers[j + 1];
+    buffer->counts[j] = buffer->counts[j + 1];
+  }
+  buffer->counts[pivots->size] = 0;
+  pivots->size--;
+  MarkDirty();
+
+  bool kept = *left.is_leaf ? left.MergeLeaf(right, split_key)
+                            : left.MergeInternal(right, separator, split_key);
+  if (kept) AddPivot(split_key, right_id);
+}
+
+BE_TEMPLATE
+bool BE_NODE::MergeLeaf(BeNode &right, Key &split_key) {
+  assert(*is_leaf);
+  assert(*right.is_leaf == *is_leaf);
+
+  bool merge = FillPercent() + right.FillPercent() <= MERGE_UP_TO_PERCENT;
+  if (*is_leaf != PACKED_LEAF) {
+    // move the pairs between the two blocks in place
+    struct BeData<Geometry> *rdata = right.data;
+    int size = data->size + rdata->size;
+    merge = merge && size <= NUM_DATA_PAIRS;
+    // merging keeps every pair here, evening out half of them
+    int here = merge ? size : size / 2;
+    if (here > (int)data->size) {
+      int n = here - data->size;
+      memcpy(data->keys + data->size, rdata->keys, n * sizeof(Key));
+      memcpy(data->values + data->size, rdata->values, n * sizeof(Value));
+      memmove(rdata->keys, rdata->keys + n, (rdata->size - n) * sizeof(Key));
+      memmove(rdata->values, rdata->values + n,
+              (rdata->size - n) * sizeof(Value));
+    } else {
+      int n = data->size - here;
+      memmove(rdata->keys + n, rdata->keys, rdata->size * sizeof(Key));
+      memmove(rdata->values + n, rdata->values, rdata->size * sizeof(Value));
+      memcpy(rdata->keys, data->keys + here, n * sizeof(Key));
+      memcpy(rdata->values, data->values + here, n * sizeof(Value));
+    }
+    data->size = here;
+    rdata->size = size - here;
+    MarkDirty();
+    SetFilter(data->keys, data->size);
+    if (merge) {
+      right.Free();
+      if (stats) stats->merges++;
+      return false;
     }
-    new_node.buffer->flush_size = buffer->flush_size;
-    buffer->size -= buffer->flush_size;
-    buffer->flush_size = 0;
+    right.MarkDirty();
+    right.SetFilter(rdata->keys, rdata->size);
+    if (stats) stats->rebalances++;
+    split_key = rdata->keys[0];
+    return true;
+  }
+
+  std::vector<Key> keys, right_keys;
+  std::vector<Value> values, right_values;
+  ReadLeaf(keys, values);
+  right.ReadLeaf(right_keys, right_values);
+  keys.insert(keys.end(), right_keys.begin(), right_keys.end());
+  values.insert(values.end(), right_values.begin(), right_values.end());
+  int size = keys.size();
+
+  if (merge && WriteLeaf(keys.data(), values.data(), size)) {
+    right.Free();
+    if (stats) stats->merges++;
+    return false;
+  }
+  if (stats) stats->rebalances++;
+  int half = HalfOf(keys.data(), values.data(), size);
+  bool fits = WriteLeaf(keys.data(), values.data(), half);
+  assert(fits);
+  fits = right.WriteLeaf(keys.data() + half, values.data() + half,
+                         size - half);
+  assert(fits);
+  split_key = keys[half];
+  return true;
+}
+
+BE_TEMPLATE
+bool BE_NODE::MergeInternal(BeNode &right, const Key &separator,
+                            Key &split_key) {
+  assert(!*is_leaf);
+  assert(!*right.is_leaf);
+
+  // the children of both in order, with their pivots and upserts
+  std::vector<Key> all_pivots(pivots->pivots, pivots->pivots + pivots->size);
+  all_pivots.push_back(separator);
+  all_pivots.insert(all_pivots.end(), right.pivots->pivots,
+                    right.pivots->pivots + right.pivots->size);
+  std::vector<uint32_t> pointers(pivots->pointers,
+                                 pivots->pointers + pivots->size + 1);
+  pointers.insert(pointers.end(), right.pivots->pointers,
+                  right.pivots->pointers + right.pivots->size + 1);
+  std::vector<uint16_t> counts(buffer->counts,
+                               buffer->counts + pivots->size + 1);
+  counts.insert(counts.end(), right.buffer->counts,
+                right.buffer->counts + right.pivots->size + 1);
+  std::vector<BeUpsert<Key, Value> > upserts(buffer->buffer,
+                                             buffer->buffer + buffer->size);
+  upserts.insert(upserts.end(), right.buffer->buffer,
+                 right.buffer->buffer + right.buffer->size);
+  int num_children = pointers.size();
+  int num_upserts = upserts.size();
+
+  // how many of the children stay here, and how many upserts go with them
+  int half = num_children;
+  if (FillPercent() + right.FillPercent() > MERGE_UP_TO_PERCENT ||
+      num_upserts > NUM_UPSERTS)
+    half = num_children / 2;
+  int num_here = 0;
+  for (int i = 0; i < half; ++i) num_here += counts[i];
+  if (num_here > NUM_UPSERTS || num_upserts - num_here > NUM_UPSERTS) {
+    // the buffers would overflow, leave both as they were
+    split_key = separator;
+    return true;
   }
-  // tighten current node buffer
-  uint32_t new_node_size = 0;
-  for (int i = 0; i < buffer->size; i++) {
-    if (buffer->buffer[i].type != INVALID) {
-      buffer->buffer[new_node_size] = buffer->buffer[i];
-      new_node_size++;
+
+  // makes [node] the parent of the children in [begin, end)
+  auto fill = [&](BeNode &node, int begin, int end, int upserts_begin) {
+    node.pivots->size = end - begin - 1;
+    std::copy(all_pivots.begin() + begin, all_pivots.begin() + end - 1,
+              node.pivots->pivots);
+    std::copy(pointers.begin() + begin, pointers.begin() + end,
+              node.pivots->pointers);
+    memset(node.buffer->counts, 0, sizeof(node.buffer->counts));
+    std::copy(counts.begin() + begin, counts.begin() + end,
+              node.buffer->counts);
+    node.buffer->size = 0;
+    node.buffer->num_ranges = 0;
+    for (int i = begin; i < end; ++i) node.buffer->size += counts[i];
+    for (int i = 0; i < node.buffer->size; ++i) {
+      node.buffer->buffer[i] = upserts[upserts_begin + i];
+      node.buffer->num_ranges += upserts[upserts_begin + i].type ==
+                                 DELETE_RANGE;
     }
+    node.MarkDirty();
+  };
+  fill(*this, 0, half, 0);
+  if (half == num_children) {
+    right.Free();
+    if (stats) stats->merges++;
+    return false;
   }
-  buffer->size = new_node_size;
+  fill(right, half, num_children, num_here);
+  if (stats) stats->rebalances++;
+  split_key = all_pivots[half - 1];
+  return true;
+}
 
-  return split_key;  // the upper half of the split
+BE_TEMPLATE
+void BE_NODE::Free() {
+  if (filters) filters->Erase(id);
+  handle.Release();
+  bmanager->DeleteBlock(id);
 }
 
-void BeNode::FullFlushSetup() {
-  Open();
-  assert(buffer->flush_size == 0);
+BE_TEMPLATE
+int BE_NODE::GroupStart(int child_index) {
+  int start = 0;
+  for (int i = 0; i < child_index; ++i) start += buffer->counts[i];
+  return start;
+}
+
+BE_TEMPLATE
+int BE_NODE::FullestChild() {
   assert(!*is_leaf);
 
-  int buf_size = (int)buffer->size;
-  int pivot_size = (int)pivots->size;
+  int to_flush = 0;
+  for (int i = 1; i < pivots->size + 1; ++i) {
+    if (buffer->counts[i] > buffer->counts[to_flush]) to_flush = i;
+  }
+  return to_flush;
+}
 
-  uint32_t child_split_key, child_split_id;
+BE_TEMPLATE
+Value BE_NODE::ApplyMerge(const Value *existing, const Value &operand) {
+  rtassert(merge_op && *merge_op, "merging without a merge operator\n");
+  return (*merge_op)(existing, operand);
+}
 
-  int nums[NUM_CHILDREN];
-  memset(nums, 0, sizeof(nums));
+BE_TEMPLATE
+CoalesceResult BE_NODE::Coalesce(BeUpsert<Key, Value> &last,
+                                 BeUpsert<Key, Value> &upsert) {
+  if (!KeysEqual<Compare>(last.key, upsert.key)) return KEPT_BOTH;
+  // a DELETE_RANGE covers other keys too
+  if (last.type == DELETE_RANGE || upsert.type == DELETE_RANGE)
+    return KEPT_BOTH;
+  switch (upsert.type) {
+    case MERGE:
+      if (last.type == DELETE) {
+        // there is nothing to merge into after the DELETE
+        upsert.type = INSERT;
+        upsert.parameter = ApplyMerge(nullptr, upsert.parameter);
+        return KEPT_BOTH;
+      }
+      // into a value, or into an older operand, the same thing for an
+      // associative operator
+      last.parameter = ApplyMerge(&last.parameter, upsert.parameter);
+      break;
+    case UPDATE:
+      if (last.type != INSERT && last.type != UPDATE) return KEPT_BOTH;
+      last.parameter = upsert.parameter;
+      break;
+    case DELETE:
+      // the key was not there before the INSERT
+      if (last.type == INSERT) return CANCELLED;
+      // the key may not have been there before a MERGE, so the DELETE that
+      // replaces it may find nothing to delete, and neither may one after it
+      if (last.type != UPDATE && last.type != MERGE && last.type != DELETE)
+        return KEPT_BOTH;
+      last.type = DELETE;
+      break;
+    default:
+      return KEPT_BOTH;
+  }
+  last.timestamp = upsert.timestamp;
+  return FOLDED;
+}
 
-  // count number of messages for each child
-  for (int i = 0; i < buf_size; ++i) {
-    ++nums[IndexOfKey(buffer->buffer[i].key)];
+BE_TEMPLATE
+int BE_NODE::CoalesceUpserts(BeUpsert<Key, Value> upserts[], int num) {
+  int size = 0;
+  for (int i = 0; i < num; ++i) {
+    CoalesceResult res =
+        size > 0 ? Coalesce(upserts[size - 1], upserts[i]) : KEPT_BOTH;
+    if (res == CANCELLED) {
+      --size;
+    } else if (res == KEPT_BOTH) {
+      if (size != i) upserts[size] = upserts[i];
+      ++size;
+    }
   }
+  return size;
+}
 
-  // find child with maximum number of messages
-  // TODO_SOMEDAY: could eagerly maintain this at the cost of disk space
-  int to_flush = 0;
-  for (int i = 1; i < pivot_size + 1; ++i) {
-    if (nums[i] > nums[to_flush]) to_flush = i;
+// Returns how many of the [num] sorted [upserts] can be moved together, at
+// most [max_num], without separating the upserts of a key (ancestors must only
+// ever hold newer upserts than their descendants). Returns 0 if the first key
+// alone has more than [max_num] upserts.
+template <class Compare, class Key, class Value>
+static int BatchSize(const BeUpsert<Key, Value> upserts[], int num,
+                     int max_num) {
+  if (num <= max_num) return num;
+  int batch = max_num;
+  while (batch > 0 &&
+         KeysEqual<Compare>(upserts[batch].key, upserts[batch - 1].key))
+    --batch;
+  return batch;
+}
+
+// Drops the upserts among the [num] sorted [upserts] that a newer
+// DELETE_RANGE among them covers. Returns how many are left, at the start of
+// [upserts].
+template <class Compare, class Key, class Value>
+static int DropOverridden(BeUpsert<Key, Value> upserts[], int num) {
+  Compare less;
+  std::vector<BeUpsert<Key, Value> > ranges;  // those that started so far
+  int size = 0;
+  for (int i = 0; i < num; ++i) {
+    BeUpsert<Key, Value> upsert = upserts[i];
+    if (upsert.type == DELETE_RANGE) {
+      // the older upserts for its first key are right before it
+      while (size > 0 && upserts[size - 1].type != DELETE_RANGE &&
+             KeysEqual<Compare>(upserts[size - 1].key, upsert.key))
+        --size;
+      ranges.push_back(upsert);
+    } else {
+      bool overridden = false;
+      for (const BeUpsert<Key, Value> &range : ranges)
+        overridden |= less(upsert.key, range.end_key) &&
+                      range.timestamp > upsert.timestamp;
+      if (overridden) continue;
+    }
+    upserts[size++] = upsert;
   }
+  return size;
+}
 
-  // reorder upserts
-  int flush_pos = buffer->size - 1;
-  int cur_pos = buffer->size - 1;
-  while (cur_pos >= 0) {
-    // find the next flushable upsert
-    if (IndexOfKey(buffer->buffer[cur_pos].key) == to_flush) {
-      // swap flush_pos, cur_pos
-      BeUpsert tmp = buffer->buffer[flush_pos];
-      buffer->buffer[flush_pos] = buffer->buffer[cur_pos];
-      buffer->buffer[cur_pos] = tmp;
-      flush_pos--;
+BE_TEMPLATE
+void BE_NODE::AddUpserts(const BeUpsert<Key, Value> upserts[], int num) {
+  assert(!*is_leaf);
+  assert(buffer->size + num <= NUM_UPSERTS);
+
+  int num_ranges = 0;
+  for (int i = 0; i < num; ++i) num_ranges += upserts[i].type == DELETE_RANGE;
+  if (num_ranges > 0) {
+    // the ranges first, the other upserts in their keys are newer
+    std::vector<BeUpsert<Key, Value> > rest;
+    int reserved = num;
+    for (int i = 0; i < num; ++i) {
+      if (upserts[i].type == DELETE_RANGE)
+        DeleteRange(upserts[i], --reserved);
+      else
+        rest.push_back(upserts[i]);
     }
-    cur_pos--;
+    AddUpserts(rest.data(), rest.size());
+    return;
   }
 
-  assert(buffer->size - 1 - flush_pos == nums[to_flush]);
+  // merge the upserts into each child's group
+  BeUpsert<Key, Value> merged[NUM_UPSERTS];
+  int size = 0;
+  int b = 0;
+  int u = 0;
+  for (int i = 0; i <= pivots->size; ++i) {
+    int group_end = b + buffer->counts[i];
+    int upserts_end = u;
+    while (upserts_end < num &&
+           (i == pivots->size ||
+            Compare()(upserts[upserts_end].key, pivots->pivots[i])))
+      ++upserts_end;
+
+    BeUpsert<Key, Value> *out =
+        std::merge(buffer->buffer + b, buffer->buffer + group_end, upserts + u,
+                   upserts + upserts_end, merged + size,
+                   &SortBeUpsertByKey<Key, Value, Compare>);
+    buffer->counts[i] = CoalesceUpserts(merged + size, out - (merged + size));
+    size += buffer->counts[i];
+    b = group_end;
+    u = upserts_end;
+  }
+  assert(u == num);
 
-  // update flush size
-  buffer->flush_size = nums[to_flush];
+  memcpy(buffer->buffer, merged, size * sizeof(BeUpsert<Key, Value>));
+  buffer->size = size;
+  MarkDirty();
+}
 
-  // sort the flush items
-  std::sort(&buffer->buffer[buffer->size - buffer->flush_size],
-            &buffer->buffer[buffer->size], &SortBeUpsert);
+BE_TEMPLATE
+void BE_NODE::DeleteRange(const BeUpsert<Key, Value> &range, int reserved) {
+  assert(range.type == DELETE_RANGE);
+  Compare less;
+
+  if (*is_leaf) {
+    std::vector<Key> keys;
+    std::vector<Value> values;
+    const Key *leaf_keys;
+    const Value *leaf_values;
+    int size = ViewLeaf(keys, values, leaf_keys, leaf_values);
+    int first = std::lower_bound(leaf_keys, leaf_keys + size, range.key,
+                                 less) -
+                leaf_keys;
+    int last = std::lower_bound(leaf_keys + first, leaf_keys + size,
+                                range.end_key, less) -
+               leaf_keys;
+    if (first == last) return;
+    if (*is_leaf != PACKED_LEAF) {
+      // close the gap in place
+      memmove(data->keys + first, data->keys + last,
+              (size - last) * sizeof(Key));
+      memmove(data->values + first, data->values + last,
+              (size - last) * sizeof(Value));
+      data->size = size - (last - first);
+      MarkDirty();
+      SetFilter(data->keys, data->size);
+      return;
+    }
+    values.erase(values.begin() + first, values.begin() + last);
+    keys.erase(keys.begin() + first, keys.begin() + last);
+    // a packed key only grows by what was removed, so fewer pairs fit
+    bool fits = WriteLeaf(keys.data(), values.data(), keys.size());
+    assert(fits);
+    return;
+  }
+
+  // drop the older upserts it overrides, and the older ranges it contains
+  BeUpsert<Key, Value> *upserts = buffer->buffer;
+  int size = 0;
+  int b = 0;
+  for (int i = 0; i <= pivots->size; ++i) {
+    int group_end = b + buffer->counts[i];
+    int kept = 0;
+    for (; b < group_end; ++b) {
+      const BeUpsert<Key, Value> &upsert = upserts[b];
+      if (upsert.timestamp < range.timestamp && !less(upsert.key, range.key) &&
+          less(upsert.key, range.end_key)) {
+        if (upsert.type != DELETE_RANGE) continue;
+        if (!less(range.end_key, upsert.end_key)) {
+          buffer->num_ranges--;
+          continue;
+        }
+      }
+      upserts[size++] = upsert;
+      kept++;
+    }
+    buffer->counts[i] = kept;
+  }
+  buffer->size = size;
+
+  // a piece of it for each child it covers
+  int first = IndexOfKey(range.key);
+  for (int i = first; i <= pivots->size; ++i) {
+    if (i > first && !less(pivots->pivots[i - 1], range.end_key)) break;
+    BeUpsert<Key, Value> piece = range;
+    if (i > first) piece.key = pivots->pivots[i - 1];
+    if (i < pivots->size && less(pivots->pivots[i], range.end_key))
+      piece.end_key = pivots->pivots[i];
+
+    if (buffer->size + reserved < NUM_UPSERTS) {
+      // after the older upserts for its first key
+      BeUpsert<Key, Value> *group = upserts + GroupStart(i);
+      BeUpsert<Key, Value> *pos =
+          std::upper_bound(group, group + buffer->counts[i], piece,
+                           &SortBeUpsertByKey<Key, Value, Compare>);
+      memmove(pos + 1, pos,
+              (upserts + buffer->size - pos) * sizeof(BeUpsert<Key, Value>));
+      *pos = piece;
+      buffer->size++;
+      buffer->counts[i]++;
+      buffer->num_ranges++;
+    } else {
+      // no room here, and nothing in the child is newer
+      BeNode child(bmanager, pivots->pointers[i], merge_op, filters, stats);
+      child.DeleteRange(piece, 0);
+    }
+  }
+  MarkDirty();
+}
+
+BE_TEMPLATE
+void BE_NODE::RemoveUpserts(int child_index, int num) {
+  assert(num <= buffer->counts[child_index]);
+
+  int start = GroupStart(child_index);
+  for (int i = start; buffer->num_ranges > 0 && i < start + num; ++i)
+    buffer->num_ranges -= buffer->buffer[i].type == DELETE_RANGE;
+  memmove(buffer->buffer + start, buffer->buffer + start + num,
+          (buffer->size - start - num) * sizeof(BeUpsert<Key, Value>));
+  buffer->size -= num;
+  buffer->counts[child_index] -= num;
+  MarkDirty();
 }
 
-void BeNode::SetId(uint32_t new_id) {
+BE_TEMPLATE
+void BE_NODE::SetId(uint32_t new_id) {
   id = new_id;
   Open();
 }
 
-FlushResult BeNode::FlushOneLeaf(BeNode &child_node, uint32_t &split_key,
-                                 uint32_t &new_id) {
-  Open();
-  child_node.Open();
+BE_TEMPLATE
+FlushResult BE_NODE::FlushOneLeaf(BeNode &child_node, int child_index,
+                                  Key &split_key, uint32_t &new_id) {
 
   assert(!*is_leaf);
   assert(*child_node.is_leaf);
-  assert(*child_node.parent == id);
 
-  BeUpsert *to_flush = buffer->buffer + (buffer->size - buffer->flush_size);
-
-  int num_to_flush = std::min(buffer->flush_size, LEAF_FLUSH_THRESHOLD);
+  BeUpsert<Key, Value> *to_flush = buffer->buffer + GroupStart(child_index);
+  int num_to_flush = BatchSize<Compare>(to_flush, buffer->counts[child_index],
+                                        LEAF_FLUSH_THRESHOLD);
+  if (num_to_flush == 0) {
+    // the first key has more upserts than that, but they add at most one
+    // pair to the leaf, so they go down together
+    num_to_flush = 1;
+    while (num_to_flush < buffer->counts[child_index] &&
+           KeysEqual<Compare>(to_flush[num_to_flush].key, to_flush[0].key))
+      ++num_to_flush;
+  }
   DebugPrint("Leaf Flush Size", std::to_string(num_to_flush));
+  if (stats) stats->leaf_flush_sizes.Add(num_to_flush);
   // we can handle all of the updates with at most a single split
-  if (child_node.UpsertLeaf(to_flush, num_to_flush)) {
-    // need to split
-    split_key = child_node.SplitLeaf(new_id);
-
-    // update child_node id if necessary
-    uint32_t flush_key = to_flush[0].key;
-    if (flush_key >= split_key) {
-      child_node.SetId(new_id);
-    }
-
-    // flush the remainder
-    child_node.UpsertLeaf(to_flush, num_to_flush);
-
-    // update sizes and return
-    buffer->size -= std::min(buffer->flush_size, LEAF_FLUSH_THRESHOLD);
-    buffer->flush_size = 0;
-    return SPLIT;
-  }
+  bool split = child_node.UpsertLeaf(to_flush, num_to_flush, split_key, new_id);
 
   // update sizes and return
-  buffer->size -= std::min(buffer->flush_size, LEAF_FLUSH_THRESHOLD);
-  buffer->flush_size = 0;
-  return NO_SPLIT;
+  RemoveUpserts(child_index, num_to_flush);
+  return split ? SPLIT : NO_SPLIT;
 }
 
-FlushResult BeNode::FlushOneInternal(BeNode &child_node) {
-  Open();
-  child_node.Open();
+BE_TEMPLATE
+FlushResult BE_NODE::FlushOneInternal(BeNode &child_node, int child_index) {
 
   assert(!*is_leaf);
   assert(!*child_node.is_leaf);
-  assert(*child_node.parent == id);
 
   int num_empty_in_child = NUM_UPSERTS - child_node.buffer->size;
+  int num_for_child = buffer->counts[child_index];
+  if (num_for_child == 0) return NO_SPLIT;
+  BeUpsert<Key, Value> *to_flush = buffer->buffer + GroupStart(child_index);
 
-  int flush_num;
-  if (num_empty_in_child >= buffer->flush_size) {
+  int flush_num = 0;
+  if (num_empty_in_child >= num_for_child) {
     // flush everything down
-    flush_num = buffer->flush_size;
+    flush_num = num_for_child;
   } else if (num_empty_in_child >= FLUSH_THRESHOLD) {
     // flush down as much as possible
-    flush_num = FLUSH_THRESHOLD;
-  } else {
-    SetId(child_node.id);
-    return ENSURE_SPACE;
+    flush_num = BatchSize<Compare>(to_flush, num_for_child, num_empty_in_child);
   }
+  if (flush_num == 0) return ENSURE_SPACE;
 
   DebugPrint("Internal Flush Size", std::to_string(flush_num));
+  if (stats) stats->internal_flush_sizes.Add(flush_num);
   // move the upserts down
-  memcpy(child_node.buffer->buffer + child_node.buffer->size,
-         buffer->buffer + (buffer->size - buffer->flush_size),
-         flush_num * sizeof(BeUpsert));
-  // update sizes
-  buffer->size -= flush_num;
-  buffer->flush_size = 0;
-  child_node.buffer->size += flush_num;
+  child_node.AddUpserts(to_flush, flush_num);
+  RemoveUpserts(child_index, flush_num);
 
   return NO_SPLIT;
 }
 
-FlushResult BeNode::FlushOneLevel(uint32_t &split_key, uint32_t &new_id) {
-  Open();
-  uint32_t child_id = pivots->pointers[IndexOfKey(
-      buffer->buffer[buffer->size - buffer->flush_size].key)];
-  BeNode child_node(bmanager, child_id);
+BE_TEMPLATE
+FlushResult BE_NODE::FlushOneLevel(Key &split_key, uint32_t &new_id) {
+  int child_index = FullestChild();
+  BeNode child_node(bmanager, pivots->pointers[child_index], merge_op,
+                    filters, stats);
+  if (stats) stats->node_flushes++;
 
-  if (*child_node.is_leaf)
-    return FlushOneLeaf(child_node, split_key, new_id);
-  else
-    return FlushOneInternal(child_node);
+  if (*child_node.is_leaf) {
+    if (FlushOneLeaf(child_node, child_index, split_key, new_id) == SPLIT)
+      AddPivot(split_key, new_id);
+  } else {
+    // when the child cannot take a batch it has to flush first, so start
+    // reading the grandchild it will flush to
+    int room = NUM_UPSERTS - child_node.buffer->size;
+    if (buffer->counts[child_index] > room && room < (int)FLUSH_THRESHOLD)
+      bmanager->Prefetch(
+          child_node.pivots->pointers[child_node.FullestChild()]);
+
+    while (FlushOneInternal(child_node, child_index) == ENSURE_SPACE) {
+      // make space in the child by flushing it first
+      if (child_node.FlushOneLevel(split_key, new_id) == SPLIT &&
+          AddPivot(split_key, new_id))
+        break;  // this node has to split first, the upserts can wait
+      // the child's upserts may now be shared with its new sibling, or all
+      // belong to it, so pick the child to flush to again
+      child_index = FullestChild();
+      child_node.SetId(pivots->pointers[child_index]);
+    }
+  }
+
+  // deletes can leave the child nearly empty
+  if (pivots->size > 0 && pivots->size < NUM_PIVOTS &&
+      child_node.FillPercent() < MERGE_BELOW_PERCENT)
+    MergeChildren(std::min(child_index, (int)pivots->size - 1));
+
+  // if the pivots are full, split this node
+  if (pivots->size < NUM_PIVOTS) return NO_SPLIT;
+  split_key = SplitInternal(new_id);
+  return SPLIT;
 }
 
-bool BeNode::AddPivot(uint32_t split_key, uint32_t new_id) {
-  Open();
+BE_TEMPLATE
+bool BE_NODE::AddPivot(const Key &split_key, uint32_t new_id) {
 
   assert(!*is_leaf);
   assert(new_id > 0);
 
   int pos = IndexOfKey(split_key);
+  // the child's upserts at or above [split_key] now belong to the new child
+  BeUpsert<Key, Value> *group = buffer->buffer + GroupStart(pos);
+  int num_left = std::lower_bound(group, group + buffer->counts[pos],
+                                  split_key,
+                                  &UpsertKeyLess<Compare, Key, Value>) -
+                 group;
   for (int j = pivots->size - 1; j >= pos; --j) {
     pivots->pointers[j + 2] = pivots->pointers[j + 1];
     pivots->pivots[j + 1] = pivots->pivots[j];
+    buffer->counts[j + 2] = buffer->counts[j + 1];
   }
+  buffer->counts[pos + 1] = buffer->counts[pos] - num_left;
+  buffer->counts[pos] = num_left;
   pivots->pivots[pos] = split_key;
   pivots->pointers[pos + 1] = new_id;
   pivots->size = pivots->size + 1;
+  MarkDirty();
+
+  // the ranges reaching past [split_key] are cut there, the new child gets
+  // the rest
+  std::vector<BeUpsert<Key, Value> > rest;
+  for (int i = 0; buffer->num_ranges > 0 && i < num_left; ++i) {
+    if (group[i].type != DELETE_RANGE ||
+        !Compare()(split_key, group[i].end_key))
+      continue;
+    rest.push_back(group[i]);
+    rest.back().key = split_key;
+    group[i].end_key = split_key;
+  }
+  for (const BeUpsert<Key, Value> &range : rest) DeleteRange(range, 0);
 
   return pivots->size == NUM_PIVOTS;
 }
 
-uint32_t BeNode::Query(uint32_t key) {
-  uint32_t orig_id = id;
-  uint32_t ret = KEY_NOT_FOUND;
-
-  uint32_t latest_timestamp = 0;
-  bool found = false;
+BE_TEMPLATE
+bool BE_NODE::Query(const Key &key, Value &value) {
+  bool present = false;
+  // the operands of the merges above the value, newest first
+  std::vector<Value> operands;
+  uint64_t hash = filters ? HashBytes(&key, sizeof(Key)) : 0;
+  FilterResult filtered = NO_FILTER;
+  int depth = 0;
+
+  // a node of our own, so the shared node is never modified
+  BeNode node(bmanager, id, merge_op, filters, stats);
   while (true) {
-    Open();
-    if (*is_leaf) {
-      for (int i = 0; i < data->size; ++i) {
-        if (data->keys[i] == key) ret = data->values[i];
+    if (*node.is_leaf) {
+      present = node.FindInLeaf(key, value);
+      if (!filters) break;
+      if (filtered == MAYBE_IN_LEAF && !present) filters->CountFalsePositive();
+      if (filtered == NO_FILTER) {
+        // read without a filter, build it for the next lookups
+        std::vector<Key> keys;
+        std::vector<Value> values;
+        node.ReadLeaf(keys, values);
+        node.SetFilter(keys.data(), keys.size());
+        if (depth != filters->LeafDepth()) filters->SetLeafDepth(depth);
       }
       break;
-    } else {
-      for (int i = 0; i < buffer->size; i++) {
-        if (buffer->buffer[i].key == key &&
-            buffer->buffer[i].timestamp >= latest_timestamp) {
-          latest_timestamp = buffer->buffer[i].timestamp;
-          if (buffer->buffer[i].type == DELETE) {
-            ret = KEY_NOT_FOUND;
-          } else {
-            ret = buffer->buffer[i].parameter;
-          }
-          found = true;
-        }
+    }
+    // the buffer is sorted, so the upserts for the key end with the latest
+    BeUpsert<Key, Value> *begin = node.buffer->buffer;
+    BeUpsert<Key, Value> *end =
+        std::upper_bound(begin, begin + node.buffer->size, key,
+                         &KeyUpsertLess<Compare, Key, Value>);
+    // the newest range covering the key, which hides the older upserts
+    uint32_t range_ts = 0;
+    if (node.buffer->num_ranges > 0) {
+      BeUpsert<Key, Value> *group =
+          begin + node.GroupStart(node.IndexOfKey(key));
+      for (BeUpsert<Key, Value> *u = group; u != end; ++u) {
+        if (u->type == DELETE_RANGE && Compare()(key, u->end_key))
+          range_ts = std::max(range_ts, u->timestamp);
       }
-      if (found) break;
+    }
+    for (; end != begin && KeysEqual<Compare>((end - 1)->key, key) &&
+           (end - 1)->type == MERGE && (end - 1)->timestamp > range_ts;
+         --end)
+      operands.push_back((end - 1)->parameter);
+    if (end != begin && KeysEqual<Compare>((end - 1)->key, key) &&
+        (end - 1)->timestamp > range_ts) {
+      present = (end - 1)->type != DELETE;
+      if (present) value = (end - 1)->parameter;
+      break;
+    }
+    if (range_ts > 0) {
+      present = false;
+      break;
     }
 
-    uint32_t next_id = pivots->pointers[IndexOfKey(key)];
+    uint32_t next_id = node.pivots->pointers[node.IndexOfKey(key)];
     assert(next_id > 0);
-    id = next_id;
+    if (filters && ++depth == filters->LeafDepth()) {
+      filtered = filters->Check(next_id, hash);
+      if (filtered == NOT_IN_LEAF) break;
+    }
+    node.SetId(next_id);
   }
 
-  id = orig_id;
-
-  if (ret == KEY_NOT_FOUND) printf("key %u not found!\n", key);
-  return ret;
+  for (size_t i = operands.size(); i > 0; --i) {
+    value = ApplyMerge(present ? &value : nullptr, operands[i - 1]);
+    present = true;
+  }
+  return present;
 }
 
-static uint32_t all_timestamp = 0;
+BE_TEMPLATE
+void BE_NODE::Scan(const Key &lo, const Key &hi,
+                   std::vector<BeUpsert<Key, Value> > &pending,
+                   const ScanVisitor &visit) {
+  Compare less;
+  if (*is_leaf) {
+    // copy out the pairs in range, the block may be evicted by the visitor
+    std::vector<std::pair<Key, Value> > pairs;
+    std::vector<Key> keys;
+    std::vector<Value> values;
+    ReadLeaf(keys, values);
+    size_t i =
+        std::lower_bound(keys.begin(), keys.end(), lo, less) - keys.begin();
+    for (; i < keys.size() && less(keys[i], hi); ++i)
+      pairs.push_back(std::make_pair(keys[i], values[i]));
+    std::sort(pending.begin(), pending.end(),
+              &SortBeUpsertByKey<Key, Value, Compare>);
+
+    // merge the leaf with the pending upserts, applying them oldest first
+    size_t p = 0, u = 0;
+    // the ranges seen so far, each hides what is older than it
+    std::vector<BeUpsert<Key, Value> > ranges;
+    while (p < pairs.size() || u < pending.size()) {
+      Key key;
+      if (u == pending.size() ||
+          (p < pairs.size() && !less(pending[u].key, pairs[p].first)))
+        key = pairs[p].first;
+      else
+        key = pending[u].key;
+
+      uint32_t range_ts = 0;
+      for (const BeUpsert<Key, Value> &range : ranges) {
+        if (less(key, range.end_key))
+          range_ts = std::max(range_ts, range.timestamp);
+      }
+      bool present = false;
+      Value value = Value();
+      if (p < pairs.size() && KeysEqual<Compare>(pairs[p].first, key)) {
+        present = range_ts == 0;
+        value = pairs[p++].second;
+      }
+      for (; u < pending.size() && KeysEqual<Compare>(pending[u].key, key);
+           ++u) {
+        if (pending[u].type == DELETE_RANGE) {
+          // even under a newer one, it may reach further
+          present = false;
+          ranges.push_back(pending[u]);
+        } else if (pending[u].timestamp < range_ts) {
+          continue;
+        } else if (pending[u].type == DELETE) {
+          present = false;
+        } else if (pending[u].type == MERGE) {
+          value = ApplyMerge(present ? &value : nullptr, pending[u].parameter);
+          present = true;
+        } else {
+          present = true;
+          value = pending[u].parameter;
+        }
+      }
+      if (present) visit(key, value);
+    }
+    return;
+  }
 
-void BeNode::Upsert(uint32_t key, UpsertFunction type, uint32_t val) {
-  Open();
-  assert(buffer->size < NUM_UPSERTS);  // needs it to not be full
+  // collect this buffer's upserts in range, they are contiguous, and the
+  // ranges from below [lo] reaching into it
+  BeUpsert<Key, Value> *end = buffer->buffer + buffer->size;
+  BeUpsert<Key, Value> *from = std::lower_bound(
+      buffer->buffer, end, lo, &UpsertKeyLess<Compare, Key, Value>);
+  if (buffer->num_ranges > 0) {
+    for (BeUpsert<Key, Value> *u = buffer->buffer + GroupStart(IndexOfKey(lo));
+         u != from; ++u) {
+      if (u->type == DELETE_RANGE && less(lo, u->end_key))
+        pending.push_back(*u);
+    }
+  }
+  pending.insert(pending.end(), from,
+                 std::lower_bound(from, end, hi,
+                                  &UpsertKeyLess<Compare, Key, Value>));
+  std::sort(pending.begin(), pending.end(),
+            &SortBeUpsertByKey<Key, Value, Compare>);
+
+  // copy the pivots, descending into the children evicts this block
+  struct BePivots<Geometry> node_pivots = *pivots;
+  int first = IndexOfKey(lo);
+  size_t u = 0;
+  // the ranges of the previous children that reach the next one
+  std::vector<BeUpsert<Key, Value> > ranges;
+  BeNode child(bmanager, node_pivots.pointers[first], merge_op, filters, stats);
+  for (int i = first; i <= node_pivots.size; ++i) {
+    Key child_lo = i == first ? lo : node_pivots.pivots[i - 1];
+    if (!less(child_lo, hi)) break;
+    Key child_hi = hi;
+    if (i < node_pivots.size && less(node_pivots.pivots[i], hi))
+      child_hi = node_pivots.pivots[i];
+
+    // hand each child the (contiguous) run of upserts in its range
+    std::vector<BeUpsert<Key, Value> > child_pending;
+    child_pending.swap(ranges);
+    for (; u < pending.size() && less(pending[u].key, child_hi); ++u)
+      child_pending.push_back(pending[u]);
+    for (const BeUpsert<Key, Value> &upsert : child_pending) {
+      if (upsert.type == DELETE_RANGE && less(child_hi, upsert.end_key))
+        ranges.push_back(upsert);
+    }
+
+    child.SetId(node_pivots.pointers[i]);
+    child.Scan(child_lo, child_hi, child_pending, visit);
+  }
+}
 
-  // add to upsert buffer
-  buffer->buffer[buffer->size++] = {
-      .key = key, .type = type, .parameter = val, .timestamp = ++all_timestamp};
+BE_TEMPLATE
+void BE_NODE::Upsert(const Key &key, UpsertFunction type, const Value &val,
+                     uint32_t timestamp) {
+  assert(buffer->size < NUM_UPSERTS);  // needs it to not be full
+  assert(type != DELETE_RANGE);
+
+  // add to upsert buffer, after any older upserts for the key
+  BeUpsert<Key, Value> *end = buffer->buffer + buffer->size;
+  BeUpsert<Key, Value> *pos = std::upper_bound(
+      buffer->buffer, end, key, &KeyUpsertLess<Compare, Key, Value>);
+  BeUpsert<Key, Value> upsert = {
+      .key = key, .type = type, .parameter = val, .timestamp = timestamp};
+  CoalesceResult res =
+      pos != buffer->buffer ? Coalesce(*(pos - 1), upsert) : KEPT_BOTH;
+  if (res == KEPT_BOTH) {
+    memmove(pos + 1, pos, (end - pos) * sizeof(BeUpsert<Key, Value>));
+    *pos = upsert;
+    buffer->size++;
+    buffer->counts[IndexOfKey(key)]++;
+  } else if (res == CANCELLED) {
+    memmove(pos - 1, pos, (end - pos) * sizeof(BeUpsert<Key, Value>));
+    buffer->size--;
+    buffer->counts[IndexOfKey(key)]--;
+  }
+  MarkDirty();
 }
 
 ///////////////////////////////////////////////////////////////
 // BeTree implementation
 ///////////////////////////////////////////////////////////////
+// Identifies block 0 as a [BeSuperblock]
+static const uint32_t SUPERBLOCK_MAGIC = 0x42655472;
+
+BE_TEMPLATE
+BE_TREE::BeTree(std::string _name, uint32_t blocks_in_memory,
+                StorageMode mode, EvictionPolicyType policy, bool durable,
+                LeafFormat leaf_format, const MergeOperator &_merge_op)
+    : BeTree(_name, CREATE_TREE, blocks_in_memory, mode, policy, durable,
+             leaf_format, _merge_op) {}
+
 // TODO: make the initial root node a leaf node
-BeTree::BeTree(std::string _name) : name(_name) {
-  bmanager = new BlockManager(_name);
+BE_TEMPLATE
+BE_TREE::BeTree(std::string _name, OpenMode open_mode,
+                uint32_t blocks_in_memory, StorageMode mode,
+                EvictionPolicyType policy, bool durable,
+                LeafFormat leaf_format, const MergeOperator &_merge_op)
+    : name(_name),
+      timestamp(0),
+      wal(nullptr),
+      merge_op(_merge_op),
+      stats() {
+  rtassert(!durable || mode != MMAP, "MMAP trees cannot be durable\n");
+  rtassert(leaf_format == PLAIN_LEAF || Node::PACKABLE,
+           "only uint32_t keys and values can be packed\n");
+  bmanager = new BlockManager<BlockSize>(_name, mode, blocks_in_memory, policy,
+                                         open_mode == OPEN_TREE);
+  // point operations touch one block per level, so readahead is wasted
+  bmanager->Advise(ACCESS_RANDOM);
+  if (durable) wal = new WriteAheadLog("./build/app/" + name + "/wal");
+
+  if (open_mode == OPEN_TREE) {
+    BeSuperblock super;
+    {
+      BlockHandle<BlockSize> block = bmanager->Pin(0);
+      memcpy(&super, block.Get()->block_buf, sizeof(super));
+    }
+    rtassert(super.magic == SUPERBLOCK_MAGIC, "no tree stored under %s\n",
+             name.c_str());
+    rtassert(super.block_size == BlockSize &&
+                 super.epsilon_percent == EpsilonPercent,
+             "tree %s has %u byte blocks and epsilon %u%%\n", name.c_str(),
+             super.block_size, super.epsilon_percent);
+    rtassert(super.key_size == sizeof(Key) &&
+                 super.value_size == sizeof(Value),
+             "tree %s has %u byte keys and %u byte values\n", name.c_str(),
+             super.key_size, super.value_size);
+    rtassert(super.clean || wal, "tree %s was not closed cleanly\n",
+             name.c_str());
+    bmanager->SetNumBlocks(super.num_blocks);
+    bmanager->LoadFreeList(super.free_list);
+    timestamp = super.timestamp;
+    root = new Node(bmanager, super.root_id, &merge_op, &leaf_filters,
+                    &stats);
+
+    // the store is back at the checkpoint, redo what was logged after it
+    if (wal) {
+      int num_replayed = 0;
+      wal->Replay([this, &num_replayed](const char *record, uint32_t size) {
+        std::vector<BeUpsert<Key, Value> > upserts;
+        uint32_t newest = timestamp;
+        for (uint32_t i = 0; i + sizeof(BeUpsert<Key, Value>) <= size;
+             i += sizeof(BeUpsert<Key, Value>)) {
+          BeUpsert<Key, Value> upsert;
+          memcpy(&upsert, record + i, sizeof(upsert));
+          // left over from before the checkpoint
+          if (upsert.timestamp <= timestamp) continue;
+          upserts.push_back(upsert);
+          newest = std::max(newest, upsert.timestamp);
+        }
+        // a batch is sorted by key, not in the order it was stamped
+        if (upserts.size() == 1 && upserts[0].type != DELETE_RANGE)
+          RootUpsert(upserts[0].key, upserts[0].type, upserts[0].parameter,
+                     upserts[0].timestamp);
+        else
+          RootUpserts(upserts.data(), upserts.size());
+        timestamp = newest;
+        num_replayed += upserts.size();
+      });
+      if (num_replayed > 0) printf("replayed %d upserts\n", num_replayed);
+    }
+    WriteSuperblock(false);
+    return;
+  }
 
   uint32_t root_id = bmanager->CreateBlock();
-  uint32_t leaf1_id = bmanager->CreateBlock();
-  uint32_t leaf2_id = bmanager->CreateBlock();
+  uint32_t leaf_id = bmanager->CreateBlock();
 
-  BeNode r1(bmanager, root_id);
-  BeNode c1(bmanager, leaf1_id);
-  BeNode c2(bmanager, leaf2_id);
+  Node r1(bmanager, root_id);
+  Node c1(bmanager, leaf_id);
 
-  // root setup
+  // root setup, over a single leaf for every key
   *r1.is_leaf = 0;
-  *r1.parent = 0;
-  r1.pivots->size = 1;
-  r1.pivots->pivots[0] = 500000000;
-  r1.pivots->pointers[0] = leaf1_id;
-  r1.pivots->pointers[1] = leaf2_id;
+  r1.pivots->size = 0;
+  r1.pivots->pointers[0] = leaf_id;
 
   // leaf setup
-  *c1.is_leaf = 1;
-  *c2.is_leaf = 1;
-  // parent setup
-  *c1.parent = root_id;
-  *c2.parent = root_id;
+  *c1.is_leaf = leaf_format;
+  r1.MarkDirty();
+  c1.MarkDirty();
 
   // instantiate root
-  root = new BeNode(bmanager, root_id);
+  root = new Node(bmanager, root_id, &merge_op, &leaf_filters, &stats);
+  WriteSuperblock(false);
 }
 
-BeTree::~BeTree() {
+BE_TEMPLATE
+BE_TREE::~BeTree() {
+  WriteSuperblock(true);
   delete root;
   delete bmanager;
+  delete wal;
 }
 
-void BeTree::CreateNewRoot(uint32_t split_key, uint32_t new_id) {
-  // create a new block for the new root
-  uint32_t root_id = bmanager->CreateBlock();
+BE_TEMPLATE
+void BE_TREE::WriteSuperblock(bool clean) {
+  // the nodes and the free list first, a superblock must never point at
+  // blocks not yet written
+  uint32_t free_list = bmanager->SaveFreeList();
+  bmanager->Sync();
+  BeSuperblock super = {.magic = SUPERBLOCK_MAGIC,
+                        .block_size = BlockSize,
+                        .epsilon_percent = EpsilonPercent,
+                        .key_size = sizeof(Key),
+                        .value_size = sizeof(Value),
+                        .root_id = root->GetId(),
+                        .num_blocks = bmanager->NumBlocks(),
+                        .timestamp = timestamp,
+                        .clean = clean,
+                        .free_list = free_list};
+  {
+    BlockHandle<BlockSize> block = bmanager->Pin(0);
+    memcpy(block.Get()->block_buf, &super, sizeof(super));
+    bmanager->MarkDirty(0);
+  }
+  if (!wal) {
+    bmanager->Sync();
+    return;
+  }
+  // a crash now comes back to this state, so the log can start over
+  bmanager->Checkpoint();
+  wal->Truncate();
+}
 
-  // set parent pointers
-  *root->parent = root_id;
-  BeNode new_child(bmanager, new_id);
-  *new_child.parent = root_id;
+BE_TEMPLATE
+void BE_TREE::RootUpsert(const Key &key, UpsertFunction type,
+                         const Value &parameter, uint32_t timestamp) {
+  if (root->buffer->size == Node::NUM_UPSERTS) FullFlush();
+  root->Upsert(key, type, parameter, timestamp);
+  // the next upsert flushes, read the child it flushes to in the meantime
+  if (root->buffer->size == Node::NUM_UPSERTS)
+    bmanager->Prefetch(root->pivots->pointers[root->FullestChild()]);
+}
 
-  // setup new root
+BE_TEMPLATE
+void BE_TREE::RootUpserts(const BeUpsert<Key, Value> upserts[], size_t num) {
+  // merge the upserts into the root in chunks as large as its free space, the
+  // flushes then move each child's whole share of a chunk at once
+  size_t done = 0;
+  while (done < num) {
+    int room = Node::NUM_UPSERTS - root->buffer->size;
+    // one past the room is enough for [BatchSize] to see where a key ends
+    int chunk = BatchSize<Compare>(upserts + done,
+                                   std::min(num - done, (size_t)room + 1),
+                                   room);
+    if (chunk == 0 && root->buffer->size == 0) {
+      // one key has more upserts than the buffer holds: they go down a
+      // buffer at a time, oldest first, so the older are always below
+      chunk = room;
+    } else if (chunk == 0) {
+      FullFlush();
+      continue;
+    }
+    root->AddUpserts(upserts + done, chunk);
+    done += chunk;
+  }
+  if (root->buffer->size == Node::NUM_UPSERTS)
+    bmanager->Prefetch(root->pivots->pointers[root->FullestChild()]);
+}
+
+BE_TEMPLATE
+uint64_t BE_TREE::LogUpserts(const BeUpsert<Key, Value> upserts[],
+                             size_t num) {
+  uint64_t lsn = wal->Append(upserts, num * sizeof(BeUpsert<Key, Value>));
+  if (wal->Size() >= CHECKPOINT_LOG_BYTES) WriteSuperblock(false);
+  return lsn;
+}
+
+BE_TEMPLATE
+void BE_TREE::CreateNewRoot(const Key &split_key, uint32_t new_id) {
+  // create a new block for the new root
   uint32_t orig_root_id = root->GetId();
+  uint32_t root_id = bmanager->CreateBlock(orig_root_id);
+
+  // setup new root
   root->SetId(root_id);
 
   *root->is_leaf = 0;
-  *root->parent = 0;
   root->pivots->size = 1;
   root->pivots->pivots[0] = split_key;
   root->pivots->pointers[0] = orig_root_id;
   root->pivots->pointers[1] = new_id;
+  root->MarkDirty();
 
   DebugPrint("CreateNewRoot", std::to_string(root_id) + "<-(" +
                                   std::to_string(orig_root_id) + ", " +
                                   std::to_string(new_id) + ")");
 }
 
-void BeTree::FullFlush() {
-  uint32_t orig_root = root->id;
+BE_TEMPLATE
+void BE_TREE::FullFlush() {
+  uint64_t num_flushed = stats.node_flushes;
+  Key split_key;
+  uint32_t new_id;
+  if (root->FlushOneLevel(split_key, new_id) == SPLIT)
+    CreateNewRoot(split_key, new_id);
+  else
+    CollapseRoot();
+  stats.flush_cascades.Add(stats.node_flushes - num_flushed);
+}
 
-  BeNode node(root->bmanager, root->id);
-  BeNode child_node(root->bmanager, root->id);
+BE_TEMPLATE
+void BE_TREE::CollapseRoot() {
+  // merges left the root over a single internal node, which takes its place
+  // once it has room for the root's upserts (they are newer)
+  if (root->pivots->size > 0) return;
+  Key split_key;
+  uint32_t new_id;
+  Node child(bmanager, root->pivots->pointers[0], &merge_op, &leaf_filters,
+             &stats);
+  if (*child.is_leaf) return;
+  while (child.buffer->size + root->buffer->size > Node::NUM_UPSERTS) {
+    if (child.FlushOneLevel(split_key, new_id) == SPLIT) {
+      root->AddPivot(split_key, new_id);
+      return;
+    }
+  }
+  child.AddUpserts(root->buffer->buffer, root->buffer->size);
+  uint32_t old_root_id = root->GetId();
+  root->SetId(child.GetId());
+  bmanager->DeleteBlock(old_root_id);
+  DebugPrint("CollapseRoot", std::to_string(old_root_id) + "->" +
+                                 std::to_string(root->GetId()));
+}
 
-  FlushResult flush_res;
-  uint32_t split_key, new_id;
-  // step 1: flush down as much as possible
-  do {
-    node.FullFlushSetup();
-    flush_res = node.FlushOneLevel(split_key, new_id);
-  } while (flush_res == ENSURE_SPACE);
+BE_TEMPLATE
+bool BE_TREE::Query(const Key &key, Value &value) {
+  std::shared_lock<std::shared_mutex> lock(tree_lock);
+  return root->Query(key, value);
+}
 
-  // step 2: bubble back up, pull up splits and push down remaining upserts
-  while (true) {
-    // if the previous node split, deal with it
-    if (flush_res == SPLIT) {
-      if (node.AddPivot(split_key, new_id)) {
-        // if the pivots are full, split node and repeat if needed
-        split_key = node.SplitInternal(new_id);
-        if (node.buffer->flush_size == 0) node.SetId(new_id);
-      } else {
-        flush_res = NO_SPLIT;
+BE_TEMPLATE
+void BE_TREE::Scan(const Key &lo, const Key &hi, const ScanVisitor &visit) {
+  if (!Compare()(lo, hi)) return;
+  std::unique_lock<std::shared_mutex> lock(tree_lock);
+  AccessHint prev_hint = bmanager->GetHint();
+  bmanager->Advise(ACCESS_SEQUENTIAL);
+  Node node(bmanager, root->GetId(), &merge_op, &leaf_filters, &stats);
+  std::vector<BeUpsert<Key, Value> > pending;
+  node.Scan(lo, hi, pending, visit);
+  bmanager->Advise(prev_hint);
+}
+
+BE_TEMPLATE
+std::vector<std::pair<Key, Value> > BE_TREE::Scan(const Key &lo,
+                                                  const Key &hi) {
+  std::vector<std::pair<Key, Value> > res;
+  Scan(lo, hi, [&res](const Key &key, const Value &value) {
+    res.push_back(std::make_pair(key, value));
+  });
+  return res;
+}
+
+BE_TEMPLATE
+void BE_TREE::BulkLoad(const PairSource &next, double fill_factor) {
+  std::unique_lock<std::shared_mutex> lock(tree_lock);
+  // the new leaves take the format of the empty one
+  uint32_t leaf_format;
+  {
+    // only the root and the empty leaf made by the constructor
+    Node leaf(bmanager, root->pivots->pointers[0], &merge_op,
+              &leaf_filters);
+    rtassert(root->pivots->size == 0 && root->buffer->size == 0 &&
+                 *leaf.is_leaf && leaf.data->size == 0,
+             "bulk loading a tree that is not empty\n");
+    leaf_format = *leaf.is_leaf;
+  }
+
+  Key key = Key(), prev_key = Key();
+  Value value = Value();
+  bool have = next(key, value);
+  if (!have) return;
+
+  // the lowest key under each node of the level being built, and its id
+  std::vector<std::pair<Key, uint32_t> > level;
+  std::vector<Key> keys;
+  std::vector<Value> values;
+  while (have) {
+    keys.clear();
+    values.clear();
+    int bytes = 0;
+    while (have) {
+      if (leaf_format == PACKED_LEAF) {
+        if constexpr (Node::PACKABLE) {
+          int pair_bytes =
+              PackedPairSize(keys.empty() ? 0 : keys.back(), key, value);
+          if (bytes + pair_bytes > Node::PACKED_BYTES) break;
+          bytes += pair_bytes;
+        }
+      } else if ((int)keys.size() == Node::NUM_DATA_PAIRS) {
+        break;
       }
+      if (!(level.empty() && keys.empty()) && !Compare()(prev_key, key))
+        rtassert(false, "bulk load keys out of order: %s after %s\n",
+                 KeyString(key).c_str(), KeyString(prev_key).c_str());
+      keys.push_back(key);
+      values.push_back(value);
+      stats.user_bytes += sizeof(Key) + sizeof(Value);
+      prev_key = key;
+      have = next(key, value);
     }
 
-    // if there are any outstanding upserts, push them down
-    if (node.buffer->flush_size > 0) {
-      FlushResult debug_res;
-      debug_res = node.FlushOneLevel(split_key, new_id);
-      assert(debug_res == NO_SPLIT);
-    }
+    uint32_t leaf_id = bmanager->CreateBlock();
+    Node leaf(bmanager, leaf_id, &merge_op, &leaf_filters, &stats);
+    *leaf.is_leaf = leaf_format;
+    bool fits = leaf.WriteLeaf(keys.data(), values.data(), keys.size());
+    assert(fits);
+    level.push_back(std::make_pair(keys[0], leaf_id));
+  }
 
-    // update node for next iteration
-    if (*node.parent == 0) {  // got to root, done! TODO: can stop earlier
-      if (flush_res == SPLIT) CreateNewRoot(split_key, new_id);
-      break;
+  // a node with NUM_PIVOTS pivots splits, so it holds one child less
+  int max_fanout = Node::NUM_CHILDREN - 1;
+  int fanout = std::max(
+      2, std::min(max_fanout, (int)(max_fanout * fill_factor + 0.5)));
+  // the root has to be internal, even over a single leaf
+  bool leaves = true;
+  while (level.size() > 1 || leaves) {
+    std::vector<std::pair<Key, uint32_t> > upper;
+    size_t num_nodes = (level.size() + fanout - 1) / fanout;
+    size_t begin = 0;
+    for (size_t n = 0; n < num_nodes; ++n) {
+      // spread the children evenly, so the last node is not left nearly empty
+      size_t end = level.size() * (n + 1) / num_nodes;
+      uint32_t node_id = bmanager->CreateBlock();
+      Node node(bmanager, node_id, &merge_op, &leaf_filters, &stats);
+      *node.is_leaf = 0;
+      node.pivots->size = end - begin - 1;
+      for (size_t c = begin; c < end; ++c) {
+        node.pivots->pointers[c - begin] = level[c].second;
+        if (c > begin) node.pivots->pivots[c - begin - 1] = level[c].first;
+      }
+      node.MarkDirty();
+      upper.push_back(std::make_pair(level[begin].first, node_id));
+      begin = end;
     }
-    node.SetId(*node.parent);
+    level.swap(upper);
+    leaves = false;
+  }
+
+  // the blocks of the empty tree are free for reuse
+  uint32_t empty_root_id = root->GetId();
+  uint32_t empty_leaf_id = root->pivots->pointers[0];
+  root->SetId(level[0].second);
+  leaf_filters.Erase(empty_leaf_id);
+  bmanager->DeleteBlock(empty_leaf_id);
+  bmanager->DeleteBlock(empty_root_id);
+  DebugPrint("BulkLoad", "root " + std::to_string(root->GetId()));
+  // nothing was logged, the new tree has to reach the disk itself
+  if (wal) WriteSuperblock(false);
+}
+
+BE_TEMPLATE
+void BE_TREE::Upsert(const Key &key, UpsertFunction type,
+                     const Value &parameter) {
+  std::unique_lock<std::shared_mutex> lock(tree_lock);
+  stats.user_bytes += UserBytes<Key, Value>(type);
+  RootUpsert(key, type, parameter, ++timestamp);
+  if (!wal) return;
+  BeUpsert<Key, Value> upsert = {
+      .key = key, .type = type, .parameter = parameter, .timestamp = timestamp};
+  uint64_t lsn = LogUpserts(&upsert, 1);
+  // sync without the lock, so writers arriving meanwhile share the next sync
+  lock.unlock();
+  wal->Commit(lsn);
+}
+
+BE_TEMPLATE
+size_t BE_TREE::ApplyBatch(BeUpsert<Key, Value> upserts[], size_t num) {
+  std::unique_lock<std::shared_mutex> lock(tree_lock);
+  // stamped in array order, so sorting by (key, timestamp) keeps the order of
+  // the upserts of each key
+  for (size_t i = 0; i < num; ++i) {
+    rtassert(upserts[i].type != MERGE || merge_op,
+             "merging into a tree without a merge operator\n");
+    upserts[i].timestamp = ++timestamp;
+    stats.user_bytes += UserBytes<Key, Value>(upserts[i].type);
   }
+  std::sort(upserts, upserts + num, &SortBeUpsertByKey<Key, Value, Compare>);
+  // the buffers need every upsert a range covers to be newer than it
+  num = DropOverridden<Compare>(upserts, num);
+  // so a key with many upserts in the batch takes few slots in the buffers
+  num = root->CoalesceUpserts(upserts, num);
+  RootUpserts(upserts, num);
+
+  if (!wal || num == 0) return num;
+  // the whole batch is one record, so it is replayed all or nothing
+  uint64_t lsn = LogUpserts(upserts, num);
+  lock.unlock();
+  wal->Commit(lsn);
+  return num;
+}
+
+BE_TEMPLATE
+void BE_TREE::Update(const Key &key, const Value &val) {
+  Upsert(key, UPDATE, val);
+}
+
+BE_TEMPLATE
+void BE_TREE::Delete(const Key &key) {
+  Upsert(key, DELETE, Value());
 }
 
-uint32_t BeTree::Query(uint32_t key) { return root->Query(key); }
+BE_TEMPLATE
+void BE_TREE::Insert(const Key &key, const Value &val) {
+  Upsert(key, INSERT, val);
+}
 
-void BeTree::Upsert(uint32_t key, UpsertFunction type, uint32_t parameter) {
-  if (root->buffer->size == NUM_UPSERTS) FullFlush();
-  root->Upsert(key, type, parameter);
+BE_TEMPLATE
+void BE_TREE::DeleteRange(const Key &lo, const Key &hi) {
+  if (!Compare()(lo, hi)) return;
+  BeUpsert<Key, Value> upsert;
+  upsert.key = lo;
+  upsert.type = DELETE_RANGE;
+  upsert.end_key = hi;
+  std::unique_lock<std::shared_mutex> lock(tree_lock);
+  upsert.timestamp = ++timestamp;
+  stats.user_bytes += UserBytes<Key, Value>(DELETE_RANGE);
+  RootUpserts(&upsert, 1);
+  if (!wal) return;
+  uint64_t lsn = LogUpserts(&upsert, 1);
+  lock.unlock();
+  wal->Commit(lsn);
 }
 
-void BeTree::Update(uint32_t key, uint32_t val) { Upsert(key, UPDATE, val); }
+BE_TEMPLATE
+void BE_TREE::Merge(const Key &key, const Value &operand) {
+  rtassert(merge_op != nullptr,
+           "merging into a tree without a merge operator\n");
+  Upsert(key, MERGE, operand);
+}
 
-void BeTree::Delete(uint32_t key) { Upsert(key, DELETE, 0); }
+BE_TEMPLATE
+BeStats BE_TREE::GetStats() {
+  // writers change the counters under the exclusive lock
+  std::shared_lock<std::shared_mutex> lock(tree_lock);
+  BeStats res = stats;
+  res.block_reads = bmanager->NumReads();
+  res.block_writes = bmanager->NumWrites();
+  res.cache_hits = bmanager->NumHits();
+  res.cache_misses = bmanager->NumMisses();
+  res.prefetches = bmanager->NumPrefetches();
+  res.undo_saves = bmanager->NumUndoSaves();
+  res.num_blocks = bmanager->NumBlocks();
+  res.free_blocks = bmanager->NumFreeBlocks();
+  // an undo copy is the block and its id
+  res.bytes_written = res.block_writes * BlockSize +
+                      res.undo_saves * (sizeof(uint32_t) + BlockSize) +
+                      (wal ? wal->BytesWritten() : 0);
+  res.filter_checks = leaf_filters.NumChecks();
+  res.filter_negatives = leaf_filters.NumNegatives();
+  res.filter_false_positives = leaf_filters.NumFalsePositives();
+  return res;
+}
 
-void BeTree::Insert(uint32_t key, uint32_t val) { Upsert(key, INSERT, val); }
+#define INSTANTIATE_BE_TREE(block_size, epsilon_percent, key, value)    \
+  template class BeNode<block_size, epsilon_percent, key, value,          \
+                        std::less<key> >;                                 \
+  template class BeTree<block_size, epsilon_percent, key, value,          \
+                        std::less<key> >;
 
+INSTANTIATE_BE_TREE(4096, 50, uint32_t, uint32_t)
+INSTANTIATE_BE_TREE(4096, 30, uint32_t, uint32_t)
+INSTANTIATE_BE_TREE(65536, 50, uint32_t, uint32_t)
+INSTANTIATE_BE_TREE(4096, 50, FixedString<32>, FixedString<16>)
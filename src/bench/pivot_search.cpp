@@ -0,0 +1,96 @@
+// Microbenchmark for the pivot search kernels used by BeNode::IndexOfKey.
+//
+// Usage: pivot_bench [num_searches]
+// Prints, for each fanout, the average time of one search for the original
+// linear scan, std::upper_bound, the branch-free scalar kernel and the
+// vectorized kernel.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <be_tree/be_tree.hpp>
+#include <pivot_search/pivot_search.hpp>
+
+typedef int (*SearchFunction)(const uint32_t *, int, uint32_t);
+
+// The search IndexOfKey used before the kernels: early exit, two compares
+__attribute__((noinline)) static int LinearSearch(const uint32_t *keys,
+                                                  int size, uint32_t key) {
+  for (int i = 0; i <= size; ++i) {
+    if ((i == size || key < keys[i]) && (i == 0 || key >= keys[i - 1]))
+      return i;
+  }
+  return size;
+}
+
+__attribute__((noinline)) static int BinarySearch(const uint32_t *keys,
+                                                  int size, uint32_t key) {
+  return std::upper_bound(keys, keys + size, key) - keys;
+}
+
+// keep the compiler from turning the scalar kernel into vector code
+__attribute__((noinline, optimize("no-tree-vectorize"))) static int
+ScalarSearch(const uint32_t *keys, int size, uint32_t key) {
+  return UpperBoundIndexScalar(keys, size, key);
+}
+
+__attribute__((noinline)) static int VectorSearch(const uint32_t *keys,
+                                                  int size, uint32_t key) {
+  return UpperBoundIndex(keys, size, key);
+}
+
+static double TimeSearch(SearchFunction search,
+                         const std::vector<uint32_t> &pivots,
+                         const std::vector<uint32_t> &queries, long &check) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < queries.size(); ++i)
+    check += search(pivots.data(), pivots.size(), queries[i]);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         queries.size();
+}
+
+int main(int argc, char **argv) {
+  int num_searches = argc > 1 ? atoi(argv[1]) : 10000000;
+  std::mt19937 gen(42);
+
+  std::vector<uint32_t> queries(num_searches);
+  for (int i = 0; i < num_searches; ++i) queries[i] = gen();
+
+#if defined(PIVOT_SEARCH_AVX2)
+  const char *kernel = "avx2";
+#elif defined(PIVOT_SEARCH_SSE2)
+  const char *kernel = "sse2";
+#else
+  const char *kernel = "scalar";
+#endif
+  printf("vector kernel: %s\n", kernel);
+  printf("%8s %10s %10s %10s %10s %8s\n", "pivots", "linear", "binary",
+         "scalar", "vector", "speedup");
+
+  int fanouts[] = {BeGeometry<4096, 50, uint32_t, uint32_t>::NUM_PIVOTS,
+                   31, 63, 127, 255, 511};
+  for (int num_pivots : fanouts) {
+    std::vector<uint32_t> pivots(num_pivots);
+    for (int i = 0; i < num_pivots; ++i) pivots[i] = gen();
+    std::sort(pivots.begin(), pivots.end());
+
+    long checks[4] = {0, 0, 0, 0};
+    double linear = TimeSearch(&LinearSearch, pivots, queries, checks[0]);
+    double binary = TimeSearch(&BinarySearch, pivots, queries, checks[1]);
+    double scalar = TimeSearch(&ScalarSearch, pivots, queries, checks[2]);
+    double vector = TimeSearch(&VectorSearch, pivots, queries, checks[3]);
+    if (checks[0] != checks[1] || checks[0] != checks[2] ||
+        checks[0] != checks[3]) {
+      fprintf(stderr, "kernels disagree at %d pivots\n", num_pivots);
+      return 1;
+    }
+    printf("%8d %8.2fns %8.2fns %8.2fns %8.2fns %7.2fx\n", num_pivots, linear,
+           binary, scalar, vector, linear / vector);
+  }
+  return 0;
+}
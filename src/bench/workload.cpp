@@ -0,0 +1,457 @@
+// YCSB-style workload benchmark for BeTree<> (uint32_t keys and values).
+//
+// Usage: workload [--option=value ...], run from the repository root
+// Loads [keys] records, then runs [ops] operations drawn from the read,
+// insert, update, delete and scan mix over a key distribution, and prints
+// one line of JSON to stdout: the options, throughput and block I/Os per
+// operation for both phases, and latency percentiles by operation. The tree
+// prints its own counters to stderr.
+//
+// Options (defaults in parentheses):
+//   --workload=a|b|c|d|e  a YCSB core workload's mix and distribution:
+//                         a 50 read/50 update zipfian, b 95/5 zipfian,
+//                         c 100 read zipfian, d 95 read/5 insert latest,
+//                         e 95 scan/5 insert zipfian; later options override
+//   --read, --insert, --update, --delete, --scan
+//                         percent of the operations of each kind (50 read,
+//                         50 update), summing to 100
+//   --distribution=uniform|zipfian|sequential|latest  (zipfian) which
+//                         records the operations pick: zipfian favors the
+//                         first records loaded, latest the last inserted,
+//                         sequential cycles through them in load order
+//   --zipf_theta          skew of zipfian and latest (0.99)
+//   --keys                records loaded (1000000)
+//   --ops                 operations run after the load (1000000)
+//   --scan_length         records a scan covers, on average (100)
+//   --insert_order=hashed|ordered  (hashed) whether the key of record i is
+//                         a scramble of i or i itself
+//   --load=insert|bulk    (insert) load with inserts or with BulkLoad
+//   --cache               blocks in memory (4096)
+//   --storage=single|file|mmap  (single) the StorageMode
+//   --policy=lru|clock|2q|arc   (lru) the block cache EvictionPolicyType
+//   --leaf_format=plain|packed  (plain)
+//   --durable=0|1         log every upsert (0)
+//   --seed                random seed (1)
+//   --name                tree stored under ./build/app/[name] (bench_tree)
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <be_tree/be_tree.hpp>
+
+typedef BeTree<> Tree;
+
+// (INSERT and the like are the tree's UpsertFunctions)
+enum Operation {
+  READ_OP,
+  INSERT_OP,
+  UPDATE_OP,
+  DELETE_OP,
+  SCAN_OP,
+  NUM_OPERATIONS
+};
+static const char *const OPERATION_NAMES[NUM_OPERATIONS] = {
+    "read", "insert", "update", "delete", "scan"};
+
+enum Distribution { UNIFORM, ZIPFIAN, SEQUENTIAL, LATEST };
+static const char *const DISTRIBUTION_NAMES[] = {"uniform", "zipfian",
+                                                 "sequential", "latest"};
+// by StorageMode, by EvictionPolicyType, and by whether leaves are packed
+static const char *const STORAGE_NAMES[] = {"file", "single", "mmap"};
+static const char *const POLICY_NAMES[] = {"lru", "clock", "2q", "arc"};
+static const char *const LEAF_FORMAT_NAMES[] = {"plain", "packed"};
+
+struct Options {
+  std::string workload = "a";
+  int mix[NUM_OPERATIONS] = {50, 0, 50, 0, 0};
+  Distribution distribution = ZIPFIAN;
+  double zipf_theta = 0.99;
+  uint64_t num_keys = 1000000;
+  uint64_t num_ops = 1000000;
+  uint32_t scan_length = 100;
+  bool hashed = true;
+  bool bulk = false;
+  uint32_t cache = 4096;
+  StorageMode storage = SINGLE_FILE;
+  EvictionPolicyType policy = LRU_POLICY;
+  LeafFormat leaf_format = PLAIN_LEAF;
+  bool durable = false;
+  uint32_t seed = 1;
+  std::string name = "bench_tree";
+};
+
+static void Usage(const char *arg) {
+  fprintf(stderr, "bad option %s, see src/bench/workload.cpp for usage\n",
+          arg);
+  exit(1);
+}
+
+// Index of [value] in [names], exits with an error if it is not there
+template <size_t N>
+static int Choice(const char *arg, const std::string &value,
+                  const char *const (&names)[N]) {
+  for (size_t i = 0; i < N; ++i)
+    if (value == names[i]) return i;
+  Usage(arg);
+  return 0;
+}
+
+static void SetWorkload(Options &opts, const char *arg,
+                        const std::string &value) {
+  // read, insert, update, delete, scan
+  static const std::map<std::string, std::vector<int> > mixes = {
+      {"a", {50, 0, 50, 0, 0}}, {"b", {95, 0, 5, 0, 0}},
+      {"c", {100, 0, 0, 0, 0}}, {"d", {95, 5, 0, 0, 0}},
+      {"e", {0, 5, 0, 0, 95}}};
+  auto it = mixes.find(value);
+  if (it == mixes.end()) Usage(arg);
+  opts.workload = value;
+  std::copy(it->second.begin(), it->second.end(), opts.mix);
+  opts.distribution = value == "d" ? LATEST : ZIPFIAN;
+}
+
+static Options ParseOptions(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *eq = strchr(arg, '=');
+    if (strncmp(arg, "--", 2) != 0 || !eq) Usage(arg);
+    std::string name(arg + 2, eq), value(eq + 1);
+    const char *v = value.c_str();
+    bool mix = false;
+    for (int op = 0; op < NUM_OPERATIONS; ++op) {
+      if (name == OPERATION_NAMES[op]) {
+        opts.mix[op] = atoi(v);
+        mix = true;
+      }
+    }
+    if (mix) {
+      opts.workload = "custom";
+    } else if (name == "workload") {
+      SetWorkload(opts, arg, value);
+    } else if (name == "distribution") {
+      opts.distribution =
+          (Distribution)Choice(arg, value, DISTRIBUTION_NAMES);
+    } else if (name == "zipf_theta") {
+      opts.zipf_theta = atof(v);
+      if (opts.zipf_theta <= 0 || opts.zipf_theta >= 1) Usage(arg);
+    } else if (name == "keys") {
+      opts.num_keys = strtoull(v, nullptr, 10);
+    } else if (name == "ops") {
+      opts.num_ops = strtoull(v, nullptr, 10);
+    } else if (name == "scan_length") {
+      opts.scan_length = atoi(v);
+    } else if (name == "insert_order") {
+      static const char *const orders[] = {"ordered", "hashed"};
+      opts.hashed = Choice(arg, value, orders);
+    } else if (name == "load") {
+      static const char *const loads[] = {"insert", "bulk"};
+      opts.bulk = Choice(arg, value, loads);
+    } else if (name == "cache") {
+      opts.cache = atoi(v);
+    } else if (name == "storage") {
+      opts.storage = (StorageMode)Choice(arg, value, STORAGE_NAMES);
+    } else if (name == "policy") {
+      opts.policy = (EvictionPolicyType)Choice(arg, value, POLICY_NAMES);
+    } else if (name == "leaf_format") {
+      opts.leaf_format =
+          Choice(arg, value, LEAF_FORMAT_NAMES) ? PACKED_LEAF : PLAIN_LEAF;
+    } else if (name == "durable") {
+      opts.durable = atoi(v);
+    } else if (name == "seed") {
+      opts.seed = atoi(v);
+    } else if (name == "name") {
+      opts.name = value;
+    } else {
+      Usage(arg);
+    }
+  }
+  int total = 0;
+  for (int op = 0; op < NUM_OPERATIONS; ++op) total += opts.mix[op];
+  if (total != 100) {
+    fprintf(stderr, "the operation mix sums to %d percent, not 100\n", total);
+    exit(1);
+  }
+  if (opts.num_keys == 0 || opts.num_keys + opts.num_ops > UINT32_MAX) {
+    fprintf(stderr, "need between 1 and 2^32 - 1 records\n");
+    exit(1);
+  }
+  if (opts.durable && opts.storage == MMAP) {
+    fprintf(stderr, "MMAP trees cannot be durable\n");
+    exit(1);
+  }
+  return opts;
+}
+
+// The key of record [index]: a bijection on 32 bit values when [hashed], so
+// records get distinct keys spread over the key space
+static uint32_t KeyOf(uint64_t index, bool hashed) {
+  uint32_t x = index;
+  if (!hashed) return x;
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+/* Draws ranks in [0, n) with P(rank i) proportional to 1 / (i + 1)^theta,
+ * with the method of Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases", as YCSB does. n can grow between draws: the zeta
+ * sum is extended one term per new item.
+ */
+class ZipfianGenerator {
+  double theta, alpha, zeta2, zetan, eta;
+  uint64_t n;
+
+ public:
+  ZipfianGenerator(double _theta)
+      : theta(_theta),
+        alpha(1 / (1 - _theta)),
+        zeta2(1 + pow(0.5, _theta)),
+        zetan(0),
+        eta(0),
+        n(0) {}
+
+  template <class Rng>
+  uint64_t Next(Rng &rng, uint64_t num_items) {
+    if (num_items != n) {
+      for (; n < num_items; ++n) zetan += 1 / pow(n + 1, theta);
+      eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan;
+    if (uz < 1) return 0;
+    if (uz < zeta2) return n > 1 ? 1 : 0;
+    uint64_t rank = n * pow(eta * u - eta + 1, alpha);
+    return std::min(rank, n - 1);
+  }
+};
+
+// Latencies of one kind of operation, in nanoseconds
+struct Latencies {
+  std::vector<uint32_t> ns;
+
+  void Add(std::chrono::steady_clock::duration d) {
+    uint64_t t =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    ns.push_back(std::min<uint64_t>(t, UINT32_MAX));
+  }
+
+  // JSON object of the count, mean, percentiles and max in microseconds
+  std::string Json() {
+    std::sort(ns.begin(), ns.end());
+    double sum = 0;
+    for (uint32_t t : ns) sum += t;
+    // the value [p] of the latencies are at most
+    auto at = [this](double p) {
+      if (ns.empty()) return 0.0;
+      size_t rank = std::max<size_t>(1, ceil(p * ns.size()));
+      return ns[std::min(rank, ns.size()) - 1] / 1000.0;
+    };
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"count\": %zu, \"mean\": %.3f, \"p50\": %.3f, "
+             "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+             ns.size(), ns.empty() ? 0.0 : sum / ns.size() / 1000, at(0.5),
+             at(0.99), at(0.999), at(1));
+    return buf;
+  }
+};
+
+// JSON object of the throughput and block I/Os of a phase of [num_ops]
+// operations that took [seconds], from the stats before and after
+static std::string PhaseJson(uint64_t num_ops, double seconds,
+                             const BeStats &before, const BeStats &after) {
+  double ops = std::max<uint64_t>(num_ops, 1);
+  uint64_t reads = after.block_reads - before.block_reads;
+  uint64_t writes = after.block_writes - before.block_writes;
+  uint64_t hits = after.cache_hits - before.cache_hits;
+  uint64_t opens = hits + after.cache_misses - before.cache_misses;
+  uint64_t user_bytes = after.user_bytes - before.user_bytes;
+  uint64_t bytes_written = after.bytes_written - before.bytes_written;
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "{\"ops\": %llu, \"seconds\": %.3f, \"ops_per_sec\": %.1f, "
+           "\"block_ios_per_op\": %.4f, \"block_reads_per_op\": %.4f, "
+           "\"block_writes_per_op\": %.4f, \"cache_hit_rate\": %.4f, "
+           "\"write_amplification\": %.2f}",
+           (unsigned long long)num_ops, seconds,
+           seconds > 0 ? num_ops / seconds : 0.0, (reads + writes) / ops,
+           reads / ops, writes / ops, opens ? (double)hits / opens : 0.0,
+           user_bytes ? (double)bytes_written / user_bytes : 0.0);
+  return buf;
+}
+
+static double Seconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+int main(int argc, char **argv) {
+  Options opts = ParseOptions(argc, argv);
+  std::mt19937_64 rng(opts.seed);
+  typedef std::chrono::steady_clock Clock;
+
+  // stdout carries only the JSON, the tree's reports go to stderr
+  FILE *json = fdopen(dup(STDOUT_FILENO), "w");
+  if (!json || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+    perror("redirecting stdout failed");
+    exit(1);
+  }
+  mkdir("./build/app", 0755);
+  mkdir(("./build/app/" + opts.name).c_str(), 0755);
+  Tree *tree = new Tree(opts.name, opts.cache, opts.storage, opts.policy,
+                        opts.durable, opts.leaf_format);
+
+  // load phase
+  BeStats start = tree->GetStats();
+  Clock::time_point t0 = Clock::now();
+  if (opts.bulk) {
+    std::vector<std::pair<uint32_t, uint32_t> > pairs(opts.num_keys);
+    for (uint64_t i = 0; i < opts.num_keys; ++i)
+      pairs[i] = std::make_pair(KeyOf(i, opts.hashed), (uint32_t)i);
+    std::sort(pairs.begin(), pairs.end());
+    tree->BulkLoad(pairs.begin(), pairs.end());
+  } else {
+    for (uint64_t i = 0; i < opts.num_keys; ++i)
+      tree->Insert(KeyOf(i, opts.hashed), i);
+  }
+  double load_seconds = Seconds(Clock::now() - t0);
+  BeStats loaded = tree->GetStats();
+
+  // run phase: records [0, num_records) were inserted, [live] of them are
+  // not deleted; updates and deletes pick live records
+  uint64_t num_records = opts.num_keys;
+  std::vector<bool> live(opts.num_keys, true);
+  uint64_t num_live = opts.num_keys, sequential = 0, scanned = 0;
+  // a scan of [scan_length] records covers this much of the key space
+  uint64_t scan_span =
+      opts.hashed ? ((1ull << 32) / opts.num_keys + 1) * opts.scan_length
+                  : opts.scan_length;
+  ZipfianGenerator zipf(opts.zipf_theta);
+  std::uniform_int_distribution<int> percent(0, 99);
+  auto pick = [&]() -> uint64_t {
+    switch (opts.distribution) {
+      case UNIFORM:
+        return std::uniform_int_distribution<uint64_t>(0, num_records - 1)(
+            rng);
+      case ZIPFIAN:
+        return zipf.Next(rng, num_records);
+      case SEQUENTIAL:
+        return sequential++ % num_records;
+      default:  // LATEST
+        return num_records - 1 - zipf.Next(rng, num_records);
+    }
+  };
+  auto pick_live = [&]() -> uint64_t {
+    if (num_live == 0) {
+      fprintf(stderr, "every record is deleted\n");
+      exit(1);
+    }
+    // retry the distribution while it is likely to find one, then scan
+    uint64_t index = pick();
+    for (int tries = 0; !live[index] && tries < 64; ++tries) index = pick();
+    while (!live[index]) index = (index + 1) % num_records;
+    return index;
+  };
+
+  Latencies latencies[NUM_OPERATIONS], all;
+  uint32_t value;
+  t0 = Clock::now();
+  for (uint64_t i = 0; i < opts.num_ops; ++i) {
+    int r = percent(rng);
+    int op = 0;
+    while (r >= opts.mix[op]) r -= opts.mix[op++];
+    Clock::time_point op_start = Clock::now();
+    switch (op) {
+      case READ_OP:
+        tree->Query(KeyOf(pick(), opts.hashed), value);
+        break;
+      case INSERT_OP:
+        tree->Insert(KeyOf(num_records, opts.hashed), i);
+        live.push_back(true);
+        num_records++;
+        num_live++;
+        break;
+      case UPDATE_OP:
+        tree->Update(KeyOf(pick_live(), opts.hashed), i);
+        break;
+      case DELETE_OP: {
+        uint64_t index = pick_live();
+        tree->Delete(KeyOf(index, opts.hashed));
+        live[index] = false;
+        num_live--;
+        break;
+      }
+      case SCAN_OP: {
+        uint64_t lo = KeyOf(pick(), opts.hashed);
+        uint64_t hi = std::min<uint64_t>(lo + scan_span, UINT32_MAX);
+        tree->Scan(lo, hi, [&scanned](uint32_t, uint32_t) { scanned++; });
+        break;
+      }
+    }
+    Clock::duration d = Clock::now() - op_start;
+    latencies[op].Add(d);
+    all.Add(d);
+  }
+  double run_seconds = Seconds(Clock::now() - t0);
+  BeStats end = tree->GetStats();
+
+  fprintf(json, "{\"workload\": {\"name\": \"%s\", \"distribution\": \"%s\"",
+          opts.workload.c_str(), DISTRIBUTION_NAMES[opts.distribution]);
+  for (int op = 0; op < NUM_OPERATIONS; ++op)
+    fprintf(json, ", \"%s\": %d", OPERATION_NAMES[op], opts.mix[op]);
+  fprintf(json,
+          ", \"zipf_theta\": %.3f, \"keys\": %llu, \"ops\": %llu, "
+          "\"scan_length\": %u, \"insert_order\": \"%s\", \"load\": \"%s\", "
+          "\"cache_blocks\": %u, \"storage\": \"%s\", \"policy\": \"%s\", "
+          "\"leaf_format\": \"%s\", \"durable\": %s, \"seed\": %u}",
+          opts.zipf_theta, (unsigned long long)opts.num_keys,
+          (unsigned long long)opts.num_ops, opts.scan_length,
+          opts.hashed ? "hashed" : "ordered", opts.bulk ? "bulk" : "insert",
+          opts.cache, STORAGE_NAMES[opts.storage], POLICY_NAMES[opts.policy],
+          LEAF_FORMAT_NAMES[opts.leaf_format == PACKED_LEAF],
+          opts.durable ? "true" : "false", opts.seed);
+  fprintf(json, ", \"load\": %s",
+          PhaseJson(opts.num_keys, load_seconds, start, loaded).c_str());
+  fprintf(json, ", \"run\": %s, \"records_per_scan\": %.1f",
+          PhaseJson(opts.num_ops, run_seconds, loaded, end).c_str(),
+          latencies[SCAN_OP].ns.empty()
+              ? 0.0
+              : (double)scanned / latencies[SCAN_OP].ns.size());
+  fprintf(json, ", \"latency_us\": {\"all\": %s", all.Json().c_str());
+  for (int op = 0; op < NUM_OPERATIONS; ++op) {
+    if (opts.mix[op] > 0)
+      fprintf(json, ", \"%s\": %s", OPERATION_NAMES[op],
+              latencies[op].Json().c_str());
+  }
+  fprintf(json, "}");
+  fprintf(json,
+          ", \"tree\": {\"blocks\": %llu, \"free_blocks\": %llu, "
+          "\"leaf_splits\": %llu, \"internal_splits\": %llu, "
+          "\"merges\": %llu, \"full_flushes\": %llu, "
+          "\"nodes_per_full_flush\": %.2f, \"filter_reads_skipped\": %llu}}\n",
+          (unsigned long long)end.num_blocks,
+          (unsigned long long)end.free_blocks,
+          (unsigned long long)end.leaf_splits,
+          (unsigned long long)end.internal_splits,
+          (unsigned long long)end.merges,
+          (unsigned long long)end.flush_cascades.count,
+          end.flush_cascades.Mean(),
+          (unsigned long long)end.filter_negatives);
+  fclose(json);
+  delete tree;
+  return 0;
+}
@@ -1,44 +1,243 @@
 #include <block_manager/block_manager.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <unordered_map>
 
+static void IOFail(std::string error_msg) {
+  perror(error_msg.c_str());
+  exit(1);
+}
+
+static void rtassert(bool cond, const char *const format...) {
+  va_list args;
+  va_start(args, format);
+  if (!cond) {
+    vfprintf(stderr, format, args);
+    exit(1);
+  }
+  va_end(args);
+}
+
+static const char *PolicyName(EvictionPolicyType policy) {
+  switch (policy) {
+    case CLOCK_POLICY:
+      return "CLOCK";
+    case TWO_Q_POLICY:
+      return "2Q";
+    case ARC_POLICY:
+      return "ARC";
+    default:
+      return "LRU";
+  }
+}
+
+static int Madvice(AccessHint hint) {
+  if (hint == ACCESS_RANDOM) return MADV_RANDOM;
+  if (hint == ACCESS_SEQUENTIAL) return MADV_SEQUENTIAL;
+  return MADV_NORMAL;
+}
+
 ///////////////////////////////////////////////////////////////
 // BlockManager implementation
 ///////////////////////////////////////////////////////////////
 
 // Constructor
-BlockManager::BlockManager(std::string _name)
-    : name(_name), cur_num_blocks(0), num_reads(0), num_writes(0) {
-  internal_mem = new Block[BLOCKS_IN_MEMORY];
-  open_blocks = new LRUCache(BLOCKS_IN_MEMORY);
+template <uint32_t BlockSize>
+BlockManager<BlockSize>::BlockManager(std::string _name, StorageMode _mode,
+                                      uint32_t _blocks_in_memory,
+                                      EvictionPolicyType _policy,
+                                      bool open_existing)
+    : num_reads(0),
+      num_writes(0),
+      num_hits(0),
+      num_misses(0),
+      num_prefetches(0),
+      name(_name),
+      mode(_mode),
+      cur_num_blocks(0),
+      blocks_in_memory(_blocks_in_memory),
+      policy(_policy),
+      open_blocks(nullptr),
+      dirty(nullptr),
+      pins(nullptr),
+      loading(nullptr),
+      stopping(false),
+      fd(-1),
+      num_allocated_blocks(0),
+      mapping(nullptr),
+      hint(ACCESS_NORMAL),
+      undo_fd(-1),
+      checkpoint_blocks(0),
+      num_undo_saves(0),
+      free_list_head(0),
+      free_list_changed(false),
+      num_frees(0),
+      num_reuses(0),
+      internal_mem(nullptr) {
+  if (mode != MMAP) {
+    internal_mem = new Block<BlockSize>[blocks_in_memory];
+    open_blocks = NewEvictionPolicy(policy, blocks_in_memory);
+    dirty = new bool[blocks_in_memory]();
+    pins = new std::atomic<int>[blocks_in_memory]();
+    loading = new bool[blocks_in_memory]();
+    // an existing block 0 has to be read, the rest waits for [SetNumBlocks]
+    written.assign(1, open_existing);
+  }
+
+  if (mode != FILE_PER_BLOCK) {
+    std::string filename = BlockFilename(0);
+    int flags = open_existing ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC;
+    fd = open(filename.c_str(), flags, 0644);
+    if (fd < 0) IOFail("Opening block file " + filename + " failed!");
+    if (open_existing) {
+      struct stat st;
+      if (fstat(fd, &st) != 0)
+        IOFail("Reading size of block file " + filename + " failed!");
+      num_allocated_blocks = st.st_size / BlockSize;
+    }
+  }
+
+  // blocks overwritten since the last checkpoint get their old contents back
+  if (open_existing) RestoreCheckpoint();
+
+  if (mode == MMAP) {
+    // reserve the whole range now so growing never moves existing blocks
+    void *addr = mmap(nullptr, MMAP_RESERVE_BYTES, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) IOFail("Reserving block mapping failed!");
+    mapping = (Block<BlockSize> *)addr;
+    if (num_allocated_blocks > 0) MapExtent(0, num_allocated_blocks);
+  }
+
+  if (mode != MMAP) {
+    for (int i = 0; i < PREFETCH_THREADS; ++i)
+      prefetchers.emplace_back(&BlockManager<BlockSize>::PrefetchLoop, this);
+  }
 }
 
 // Destructor
-BlockManager::~BlockManager() {
-  // write back blocks
-  uint32_t pos;
-  std::unordered_map<uint32_t, LRUNode*>::iterator it = open_blocks->GetBegin();
-  std::unordered_map<uint32_t, LRUNode*>::iterator eit = open_blocks->GetEnd();
-  for (; it != eit; ++it) {
-    pos = open_blocks->Get(it->second->id);
-    // printf("write back: pos %d to id %d \n", pos, it->second->id);
-    WriteBlock(it->second->id, pos);
+template <uint32_t BlockSize>
+BlockManager<BlockSize>::~BlockManager() {
+  if (mode == MMAP) {
+    // dirty pages are written back by the kernel, even after the unmap
+    if (munmap(mapping, MMAP_RESERVE_BYTES) != 0)
+      IOFail("Unmapping block file failed!");
+    close(fd);
+    printf("num blocks mapped: %u\n", num_allocated_blocks);
+    if (num_frees > 0)
+      printf("num blocks freed: %d, reused: %d\n", num_frees, num_reuses);
+    return;
   }
+
+  {
+    std::lock_guard<std::mutex> lock(prefetch_lock);
+    stopping = true;
+  }
+  prefetch_ready.notify_all();
+  for (size_t i = 0; i < prefetchers.size(); ++i) prefetchers[i].join();
+
+  // write back dirty blocks
+  open_blocks->ForEach([this](uint32_t id, uint32_t pos) {
+    // printf("write back: pos %d to id %d \n", pos, id);
+    if (dirty[pos]) WriteBlock(id, pos);
+  });
   delete[] internal_mem;
+  delete[] dirty;
+  delete[] pins;
+  delete[] loading;
   delete open_blocks;
-  printf("num block reads: %d\nnum block writes: %d\n", num_reads, num_writes);
+  if (fd >= 0) close(fd);
+  if (undo_fd >= 0) close(undo_fd);
+  printf("num block reads: %llu\nnum block writes: %llu\n",
+         (unsigned long long)num_reads, (unsigned long long)num_writes);
+  uint64_t num_opens = num_hits + num_misses;
+  printf("cache hits: %llu/%llu (%.2f%%, %s)\n",
+         (unsigned long long)num_hits, (unsigned long long)num_opens,
+         num_opens ? 100.0 * num_hits / num_opens : 0.0, PolicyName(policy));
+  printf("num block prefetches: %llu\n", (unsigned long long)num_prefetches);
+  if (undo_fd >= 0)
+    printf("num undo saves: %llu\n", (unsigned long long)num_undo_saves);
+  if (num_frees > 0)
+    printf("num blocks freed: %d, reused: %d\n", num_frees, num_reuses);
 }
 
-std::string BlockManager::BlockFilename(uint32_t id) {
+// In SINGLE_FILE and MMAP mode every id shares the one "blocks" file
+template <uint32_t BlockSize>
+std::string BlockManager<BlockSize>::BlockFilename(uint32_t id) {
+  if (mode != FILE_PER_BLOCK) return "./build/app/" + name + "/blocks";
   return "./build/app/" + name + "/" + std::to_string(id);
 }
 
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::EnsureAllocated(uint32_t id) {
+  if (id < num_allocated_blocks) return;
+
+  uint32_t new_num_blocks =
+      (id / BLOCKS_PER_EXTENT + 1) * BLOCKS_PER_EXTENT;
+  off_t start = (off_t)num_allocated_blocks * BlockSize;
+  off_t len = (off_t)(new_num_blocks - num_allocated_blocks) * BlockSize;
+  // not every filesystem can reserve space up front; a sparse file is fine
+  int err = posix_fallocate(fd, start, len);
+  if (err != 0 && ftruncate(fd, start + len) != 0)
+    IOFail("Growing block file to " + std::to_string(new_num_blocks) +
+           " blocks failed!");
+  if (mode == MMAP) MapExtent(num_allocated_blocks, new_num_blocks);
+  num_allocated_blocks = new_num_blocks;
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::MapExtent(uint32_t start, uint32_t end) {
+  if ((uint64_t)end * BlockSize > MMAP_RESERVE_BYTES) {
+    fprintf(stderr, "Block file outgrew the %llu byte mapping!\n",
+            (unsigned long long)MMAP_RESERVE_BYTES);
+    exit(1);
+  }
+  size_t len = (size_t)(end - start) * BlockSize;
+  void *addr = mmap(mapping + start, len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, (off_t)start * BlockSize);
+  if (addr == MAP_FAILED)
+    IOFail("Mapping blocks " + std::to_string(start) + " to " +
+           std::to_string(end) + " failed!");
+  if (hint != ACCESS_NORMAL) madvise(addr, len, Madvice(hint));
+}
+
 // Create Block: Returns block ID
-uint32_t BlockManager::CreateBlock() {
+template <uint32_t BlockSize>
+uint32_t BlockManager<BlockSize>::CreateBlock(uint32_t near) {
+  if (!free_ids.empty()) {
+    auto next = free_ids.lower_bound(near);
+    if (next == free_ids.end() ||
+        (next != free_ids.begin() && near - *std::prev(next) <= *next - near))
+      --next;
+    uint32_t id = *next;
+    free_ids.erase(next);
+    free_list_changed = true;
+    num_reuses++;
+    // the file (or its space) is still there
+    ResetBlock(id);
+    return id;
+  }
+
   uint32_t id = ++cur_num_blocks;
+  if (mode != MMAP) {
+    std::unique_lock<std::shared_mutex> lock(frame_lock);
+    written.resize(id + 1, false);
+  }
+  if (mode != FILE_PER_BLOCK) {
+    EnsureAllocated(id);
+    return id;
+  }
   std::string filename = BlockFilename(id);
   std::ofstream fout(filename);
   fout.flush();
@@ -46,57 +245,463 @@ uint32_t BlockManager::CreateBlock() {
   return id;
 }
 
-// Delete Block
-void BlockManager::DeleteBlock(uint32_t id) {
-  std::string filename = BlockFilename(id);
-  if (remove(filename.c_str()) != 0) {
-    std::string error_msg = "Deleting Block " + std::to_string(id) + " failed!";
-    perror(error_msg.c_str());
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::ResetBlock(uint32_t id) {
+  if (mode == MMAP) {
+    memset(mapping[id].block_buf, 0, BlockSize);
+    return;
+  }
+  std::unique_lock<std::shared_mutex> lock(frame_lock);
+  // not read from disk any more, as if it was never written
+  written[id] = false;
+  uint32_t pos;
+  while (true) {
+    pos = open_blocks->Find(id);
+    if (pos >= blocks_in_memory || !loading[pos]) break;
+    // a read ahead of it is under way, let it land first
+    frame_loaded.wait(lock);
+  }
+  if (pos >= blocks_in_memory) return;
+  memset(internal_mem[pos].block_buf, 0, BlockSize);
+  dirty[pos] = false;
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::SetNumBlocks(uint32_t num_blocks) {
+  cur_num_blocks = num_blocks;
+  if (mode != MMAP) {
+    std::unique_lock<std::shared_mutex> lock(frame_lock);
+    written.assign(num_blocks + 1, true);
+  }
+  if (mode != FILE_PER_BLOCK) EnsureAllocated(num_blocks);
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::Sync() {
+  if (mode == MMAP) {
+    if (num_allocated_blocks > 0 &&
+        msync(mapping, (size_t)num_allocated_blocks * BlockSize, MS_SYNC) != 0)
+      IOFail("Syncing block mapping failed!");
+    return;
+  }
+  {
+    std::unique_lock<std::shared_mutex> lock(frame_lock);
+    open_blocks->ForEach([this](uint32_t id, uint32_t pos) {
+      if (!dirty[pos]) return;
+      WriteBlock(id, pos);
+      dirty[pos] = false;
+    });
+  }
+  SyncFiles();
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::SyncFiles() {
+  if (fd >= 0 && fdatasync(fd) != 0) IOFail("Syncing block file failed!");
+  std::set<uint32_t> ids;
+  {
+    std::unique_lock<std::shared_mutex> lock(frame_lock);
+    ids.swap(unsynced_files);
+  }
+  for (uint32_t id : ids) {
+    std::string filename = BlockFilename(id);
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file < 0 || fdatasync(file) != 0)
+      IOFail("Syncing block file " + filename + " failed!");
+    close(file);
+  }
+  // new files are only there once their folder entries are
+  std::string folder = "./build/app/" + name;
+  int dir = open(folder.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir < 0 || fsync(dir) != 0)
+    IOFail("Syncing folder " + folder + " failed!");
+  close(dir);
+}
+
+// Delete Block: the block keeps its file (or its space in the file) until
+// its id is reused
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::DeleteBlock(uint32_t id) {
+  if (id == 0 || id > cur_num_blocks || !free_ids.insert(id).second) {
+    fprintf(stderr, "Deleting Block %u, which is not in use!\n", id);
     exit(1);
   }
+  free_list_changed = true;
+  num_frees++;
+  if (mode == MMAP) return;
+  // nothing to write back any more
+  std::shared_lock<std::shared_mutex> lock(frame_lock);
+  uint32_t pos = open_blocks->Find(id);
+  if (pos < blocks_in_memory) dirty[pos] = false;
+}
+
+// A block of the free list: | next block | # ids | ids |
+template <uint32_t BlockSize>
+uint32_t BlockManager<BlockSize>::SaveFreeList() {
+  if (!free_list_changed) return free_list_head;
+  const size_t ids_per_block = BlockSize / sizeof(uint32_t) - 2;
+  std::vector<uint32_t> ids(free_ids.begin(), free_ids.end());
+  size_t num_list_blocks = (ids.size() + ids_per_block - 1) / ids_per_block;
+  // the i-th block of the list is the i-th free id, written last to first so
+  // each can point at the next
+  uint32_t head = 0;
+  for (size_t i = num_list_blocks; i-- > 0;) {
+    size_t begin = i * ids_per_block;
+    uint32_t num = std::min(ids_per_block, ids.size() - begin);
+    {
+      BlockHandle<BlockSize> block = Pin(ids[i]);
+      uint32_t *words = (uint32_t *)block.Get()->block_buf;
+      words[0] = head;
+      words[1] = num;
+      memcpy(words + 2, ids.data() + begin, num * sizeof(uint32_t));
+    }
+    MarkDirty(ids[i]);
+    head = ids[i];
+  }
+  free_list_head = head;
+  free_list_changed = false;
+  return head;
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::LoadFreeList(uint32_t head) {
+  free_ids.clear();
+  for (uint32_t id = head; id != 0;) {
+    BlockHandle<BlockSize> block = Pin(id);
+    const uint32_t *words = (const uint32_t *)block.Get()->block_buf;
+    free_ids.insert(words + 2, words + 2 + words[1]);
+    id = words[0];
+  }
+  free_list_head = head;
+  free_list_changed = false;
 }
 
 // Open Block: Returns pos in internal_mem
-uint32_t BlockManager::OpenBlock(uint32_t id) {
-  // fprintf(stderr, "open_block called: %u\n", id);
-  uint32_t pos = open_blocks->Get(id);
-  // fprintf(stderr, "pos from get: %u\n", pos);
-  if (pos < BLOCKS_IN_MEMORY) return pos;  // already open
-
-  // get a position in internal memory
-  uint32_t evicted_id;
-  pos = open_blocks->Put(id, &evicted_id);
-
-  // write back old block and read new block from disk to memory
-  if (evicted_id > 0) {
+template <uint32_t BlockSize>
+uint32_t BlockManager<BlockSize>::OpenBlock(uint32_t id) {
+  uint32_t pos = PinFrame(id);
+  pins[pos]--;
+  return pos;
+}
+
+template <uint32_t BlockSize>
+uint32_t BlockManager<BlockSize>::PinFrame(uint32_t id, bool prefetch) {
+  {
+    // reading ahead is not a use of the block
+    std::shared_lock<std::shared_mutex> lock(frame_lock);
+    uint32_t pos = prefetch ? open_blocks->Find(id) : open_blocks->Get(id);
+    if (pos < blocks_in_memory && !loading[pos]) {  // already open
+      pins[pos]++;
+      if (!prefetch) num_hits++;
+      return pos;
+    }
+  }
+
+  std::unique_lock<std::shared_mutex> lock(frame_lock);
+  uint32_t pos, evicted_id = NO_EVICTION;
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::seconds(PIN_WAIT_SECONDS);
+  while (true) {
+    // another thread may have opened it while the lock was released
+    pos = prefetch ? open_blocks->Find(id) : open_blocks->Get(id);
+    if (pos < blocks_in_memory && !loading[pos]) {
+      pins[pos]++;
+      if (!prefetch) num_hits++;
+      return pos;
+    }
+    if (pos < blocks_in_memory) {
+      frame_loaded.wait(lock);
+      continue;
+    }
+
+    // get a position in internal memory
+    pos = open_blocks->Put(id, &evicted_id,
+                           [this](uint32_t p) { return pins[p] == 0; });
+    if (pos < blocks_in_memory) break;
+    // every block is pinned by a reader, wait for one to be released
+    rtassert(std::chrono::steady_clock::now() < deadline,
+             "all %u blocks in memory stayed pinned for %d seconds\n",
+             blocks_in_memory, PIN_WAIT_SECONDS);
+    frame_loaded.wait_for(lock, std::chrono::milliseconds(1));
+  }
+
+  // write back old block (if modified) before unlocking, so nobody can read
+  // the stale copy from disk meanwhile
+  if (prefetch)
+    num_prefetches++;
+  else
+    num_misses++;
+  if (evicted_id != NO_EVICTION && dirty[pos]) {
     // printf("evicted: %u\n", evicted_id);
     WriteBlock(evicted_id, pos);
   }
-  memset(internal_mem[pos].block_buf, 0, sizeof(internal_mem[pos].block_buf));
-  ReadBlock(id, pos);
+  dirty[pos] = false;
+  pins[pos] = 1;
+  loading[pos] = true;
+  bool fresh = id >= written.size() || !written[id];
+
+  // read new block from disk to memory without blocking hits on other blocks
+  lock.unlock();
+  if (fresh)
+    memset(internal_mem[pos].block_buf, 0, BlockSize);
+  else
+    ReadBlock(id, pos);
+  lock.lock();
+  loading[pos] = false;
+  lock.unlock();
+  frame_loaded.notify_all();
 
   // return position
   return pos;
 }
 
-// TODO: Consider keeping fstream open so that we don't have to open/close twice
+template <uint32_t BlockSize>
+Block<BlockSize> *BlockManager<BlockSize>::PinBlock(uint32_t id) {
+  if (mode == MMAP) return mapping + id;
+  return internal_mem + PinFrame(id);
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::Prefetch(uint32_t id) {
+  if (mode == MMAP) {
+    madvise(mapping + id, BlockSize, MADV_WILLNEED);
+    return;
+  }
+  {
+    std::shared_lock<std::shared_mutex> lock(frame_lock);
+    if (open_blocks->Find(id) < blocks_in_memory) return;
+  }
+  std::lock_guard<std::mutex> lock(prefetch_lock);
+  // reading ahead more than half the cache would evict blocks still in use
+  if (prefetch_queue.size() >= blocks_in_memory / 2) return;
+  prefetch_queue.push_back(id);
+  prefetch_ready.notify_one();
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::PrefetchLoop() {
+  while (true) {
+    uint32_t id;
+    {
+      std::unique_lock<std::mutex> lock(prefetch_lock);
+      prefetch_ready.wait(
+          lock, [this] { return stopping || !prefetch_queue.empty(); });
+      if (stopping) return;
+      id = prefetch_queue.front();
+      prefetch_queue.pop_front();
+    }
+    pins[PinFrame(id, true)]--;
+  }
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::UnpinBlock(Block<BlockSize> *block) {
+  if (mode == MMAP) return;
+  pins[block - internal_mem]--;
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::Advise(AccessHint _hint) {
+  hint = _hint;
+  if (mode != MMAP || num_allocated_blocks == 0) return;
+  // only a hint, so a failure is not worth stopping for
+  madvise(mapping, (size_t)num_allocated_blocks * BlockSize, Madvice(hint));
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::MarkDirty(uint32_t id) {
+  if (mode == MMAP) return;  // stores go straight to the page cache
+  // shared, a prefetch may be giving another block a position
+  std::shared_lock<std::shared_mutex> lock(frame_lock);
+  uint32_t pos = open_blocks->Find(id);
+  if (pos < blocks_in_memory) dirty[pos] = true;
+}
+
 // Write Block: Writes the block id back to disk
-void BlockManager::WriteBlock(uint32_t id, int pos) {
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::WriteBlock(uint32_t id, int pos) {
   // uint32_t pos = open_blocks->get(id);
-  if (pos >= BLOCKS_IN_MEMORY) return;  // id is not open
-  std::string filename = BlockFilename(id);
-  std::ofstream fout(filename, std::ios::out | std::ios::binary);
-  fout.write((char*)internal_mem[pos].block_buf, BLOCK_SIZE);
-  fout.flush();
-  fout.close();
+  if ((uint32_t)pos >= blocks_in_memory) return;  // id is not open
+  if (undo_fd >= 0 && id <= checkpoint_blocks && !saved[id]) SaveUndo(id);
+  written[id] = true;
+  WriteToDisk(id, internal_mem[pos].block_buf);
   num_writes++;
 }
 
 // Read Block: Reads the block id from disk
-void BlockManager::ReadBlock(uint32_t id, int pos) {
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::ReadBlock(uint32_t id, int pos) {
+  ReadFromDisk(id, internal_mem[pos].block_buf);
+  num_reads++;
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::WriteToDisk(uint32_t id,
+                                          const unsigned char *buf) {
+  if (mode != FILE_PER_BLOCK) {
+    off_t offset = (off_t)id * BlockSize;
+    size_t done = 0;
+    while (done < BlockSize) {
+      ssize_t res = pwrite(fd, buf + done, BlockSize - done, offset + done);
+      if (res < 0 && errno == EINTR) continue;
+      if (res <= 0) IOFail("Writing Block " + std::to_string(id) + " failed!");
+      done += res;
+    }
+    return;
+  }
+  // overwritten in place, never truncated, so a crash leaves the old or the
+  // new bytes of each page
+  std::string filename = BlockFilename(id);
+  int file = open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (file < 0) IOFail("Opening block file " + filename + " failed!");
+  size_t done = 0;
+  while (done < BlockSize) {
+    ssize_t res = pwrite(file, buf + done, BlockSize - done, done);
+    if (res < 0 && errno == EINTR) continue;
+    if (res <= 0) IOFail("Writing Block " + std::to_string(id) + " failed!");
+    done += res;
+  }
+  close(file);
+  unsynced_files.insert(id);
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::ReadFromDisk(uint32_t id, unsigned char *buf) {
+  if (mode != FILE_PER_BLOCK) {
+    // blocks that were never written read back as zeros
+    off_t offset = (off_t)id * BlockSize;
+    size_t done = 0;
+    while (done < BlockSize) {
+      ssize_t res = pread(fd, buf + done, BlockSize - done, offset + done);
+      if (res < 0 && errno == EINTR) continue;
+      if (res < 0) IOFail("Reading Block " + std::to_string(id) + " failed!");
+      if (res == 0) break;  // past the end of the file
+      done += res;
+    }
+    // only a short read leaves anything to clear
+    memset(buf + done, 0, BlockSize - done);
+    return;
+  }
   std::string filename = BlockFilename(id);
   std::ifstream fin(filename, std::ios::in | std::ios::binary);
-  fin.read((char*)internal_mem[pos].block_buf, BLOCK_SIZE);
+  fin.read((char *)buf, BlockSize);
+  std::streamsize done = fin.gcount();
+  memset(buf + done, 0, BlockSize - done);
   fin.close();
-  num_reads++;
 }
+
+///////////////////////////////////////////////////////////////
+// Checkpoints
+///////////////////////////////////////////////////////////////
+
+// An undo record is the id of a block followed by its checkpointed contents
+template <uint32_t BlockSize>
+std::string BlockManager<BlockSize>::UndoFilename() {
+  return "./build/app/" + name + "/undo";
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::SaveUndo(uint32_t id) {
+  unsigned char record[sizeof(uint32_t) + BlockSize];
+  memcpy(record, &id, sizeof(uint32_t));
+  ReadFromDisk(id, record + sizeof(uint32_t));
+  size_t done = 0;
+  while (done < sizeof(record)) {
+    ssize_t res = write(undo_fd, record + done, sizeof(record) - done);
+    if (res < 0 && errno == EINTR) continue;
+    if (res <= 0) IOFail("Saving Block " + std::to_string(id) + " failed!");
+    done += res;
+  }
+  // the old contents must be on disk before they are overwritten
+  if (fdatasync(undo_fd) != 0) IOFail("Syncing undo file failed!");
+  saved[id] = true;
+  num_undo_saves++;
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::RestoreCheckpoint() {
+  std::string filename = UndoFilename();
+  int undo = open(filename.c_str(), O_RDWR);
+  if (undo < 0) return;  // never checkpointed
+
+  // a torn last record was never acted on, its block was not overwritten
+  unsigned char record[sizeof(uint32_t) + BlockSize];
+  int num_restored = 0;
+  while (true) {
+    size_t done = 0;
+    while (done < sizeof(record)) {
+      ssize_t res = read(undo, record + done, sizeof(record) - done);
+      if (res < 0 && errno == EINTR) continue;
+      if (res < 0) IOFail("Reading undo file " + filename + " failed!");
+      if (res == 0) break;
+      done += res;
+    }
+    if (done < sizeof(record)) break;
+    uint32_t id;
+    memcpy(&id, record, sizeof(uint32_t));
+    WriteToDisk(id, record + sizeof(uint32_t));
+    num_restored++;
+  }
+
+  if (num_restored > 0) {
+    SyncFiles();
+    if (ftruncate(undo, 0) != 0 || fdatasync(undo) != 0)
+      IOFail("Clearing undo file " + filename + " failed!");
+    printf("restored %d blocks to the last checkpoint\n", num_restored);
+  }
+  close(undo);
+}
+
+template <uint32_t BlockSize>
+void BlockManager<BlockSize>::Checkpoint() {
+  if (mode == MMAP) {
+    fprintf(stderr, "MMAP blocks are written back by the kernel at any time, "
+                    "they cannot be checkpointed!\n");
+    exit(1);
+  }
+  Sync();
+  if (undo_fd < 0) {
+    std::string filename = UndoFilename();
+    undo_fd = open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (undo_fd < 0) IOFail("Opening undo file " + filename + " failed!");
+    // a crash must find the new file, and its folder entry is all there is
+    SyncFiles();
+  }
+  // the old checkpoint must not come back once the caller moves on
+  if (ftruncate(undo_fd, 0) != 0 || fdatasync(undo_fd) != 0)
+    IOFail("Clearing undo file failed!");
+  checkpoint_blocks = cur_num_blocks;
+  saved.assign(cur_num_blocks + 1, false);
+}
+
+///////////////////////////////////////////////////////////////
+// BlockHandle implementation
+///////////////////////////////////////////////////////////////
+
+template <uint32_t BlockSize>
+BlockHandle<BlockSize>::BlockHandle(BlockHandle &&other)
+    : bmanager(other.bmanager), block(other.block) {
+  other.block = nullptr;
+}
+
+template <uint32_t BlockSize>
+BlockHandle<BlockSize> &BlockHandle<BlockSize>::operator=(
+    BlockHandle &&other) {
+  if (this == &other) return *this;
+  Release();
+  bmanager = other.bmanager;
+  block = other.block;
+  other.block = nullptr;
+  return *this;
+}
+
+template <uint32_t BlockSize>
+void BlockHandle<BlockSize>::Release() {
+  if (block) bmanager->UnpinBlock(block);
+  block = nullptr;
+}
+
+template class BlockHandle<4096>;
+template class BlockHandle<65536>;
+template class BlockManager<4096>;
+template class BlockManager<65536>;
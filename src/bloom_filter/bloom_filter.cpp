@@ -0,0 +1,84 @@
+#include <bloom_filter/bloom_filter.hpp>
+#include <cstdio>
+#include <mutex>
+
+uint64_t HashBytes(const void *data, size_t size) {
+  // FNV-1a over the bytes, then the MurmurHash3 finalizer to spread them
+  const unsigned char *bytes = (const unsigned char *)data;
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+BloomFilter::BloomFilter(size_t num_keys)
+    : bits(((num_keys * BLOOM_BITS_PER_KEY + 511) / 512 + 1) * 8, 0),
+      // ln 2 * bits per key minimizes the false positives
+      num_hashes(BLOOM_BITS_PER_KEY * 69 / 100) {}
+
+// All the probes of a key fall in one 512 bit block, so a check touches one
+// cache line. The low half of the hash picks the block (with a multiply
+// instead of a division), the high half the bits in it by double hashing.
+static inline size_t Block(uint64_t hash, size_t num_words) {
+  return ((uint64_t)(uint32_t)hash * (num_words / 8) >> 32) * 8;
+}
+
+static inline uint32_t Probe(uint64_t hash, int i) {
+  uint32_t h1 = hash >> 32, h2 = (h1 >> 17) | (h1 << 15) | 1;
+  return (h1 + i * h2) % 512;
+}
+
+void BloomFilter::Add(uint64_t hash) {
+  uint64_t *block = &bits[Block(hash, bits.size())];
+  for (int i = 0; i < num_hashes; ++i) {
+    uint32_t bit = Probe(hash, i);
+    block[bit / 64] |= 1ull << (bit % 64);
+  }
+}
+
+bool BloomFilter::MayContain(uint64_t hash) const {
+  const uint64_t *block = &bits[Block(hash, bits.size())];
+  for (int i = 0; i < num_hashes; ++i) {
+    uint32_t bit = Probe(hash, i);
+    if (!(block[bit / 64] & (1ull << (bit % 64)))) return false;
+  }
+  return true;
+}
+
+LeafFilters::LeafFilters()
+    : num_checks(0), num_negatives(0), num_false_positives(0), leaf_depth(0) {}
+
+LeafFilters::~LeafFilters() {
+  int num_absent = num_negatives + num_false_positives;
+  printf("leaf filter checks: %d, reads skipped: %d, false positives: %d "
+         "(%.2f%% of absent keys)\n",
+         num_checks.load(), num_negatives.load(), num_false_positives.load(),
+         num_absent ? 100.0 * num_false_positives / num_absent : 0.0);
+}
+
+void LeafFilters::Set(uint32_t id, BloomFilter &&filter) {
+  std::unique_lock<std::shared_mutex> guard(lock);
+  if (id >= filters.size()) filters.resize(id + 1);
+  filters[id] = std::move(filter);
+}
+
+void LeafFilters::Erase(uint32_t id) {
+  std::unique_lock<std::shared_mutex> guard(lock);
+  if (id < filters.size()) filters[id] = BloomFilter();
+}
+
+FilterResult LeafFilters::Check(uint32_t id, uint64_t hash) {
+  std::shared_lock<std::shared_mutex> guard(lock);
+  if (id >= filters.size() || filters[id].Empty()) return NO_FILTER;
+  num_checks++;
+  if (filters[id].MayContain(hash)) return MAYBE_IN_LEAF;
+  num_negatives++;
+  return NOT_IN_LEAF;
+}
@@ -0,0 +1,287 @@
+#include <eviction_policy/eviction_policy.hpp>
+#include <lru_cache/lru_cache.hpp>
+#include <algorithm>
+
+EvictionPolicy *NewEvictionPolicy(EvictionPolicyType type, int cap) {
+  switch (type) {
+    case CLOCK_POLICY:
+      return new ClockCache(cap);
+    case TWO_Q_POLICY:
+      return new TwoQCache(cap);
+    case ARC_POLICY:
+      return new ARCCache(cap);
+    default:
+      return new LRUCache(cap);
+  }
+}
+
+///////////////////////////////////////////////////////////////
+// ClockCache implementation
+///////////////////////////////////////////////////////////////
+
+ClockCache::ClockCache(int _cap)
+    : cap(_cap),
+      size(0),
+      ids(_cap, 0),
+      referenced(new std::atomic<bool>[_cap]()),
+      hand(0) {}
+
+uint32_t ClockCache::Get(uint32_t id) {
+  std::unordered_map<uint32_t, uint32_t>::iterator it = positions.find(id);
+  if (it == positions.end()) return cap + 1;
+  // no lock needed, a hit only sets the bit
+  referenced[it->second].store(true, std::memory_order_relaxed);
+  return it->second;
+}
+
+uint32_t ClockCache::Find(uint32_t id) {
+  std::unordered_map<uint32_t, uint32_t>::iterator it = positions.find(id);
+  if (it == positions.end()) return cap + 1;
+  return it->second;
+}
+
+uint32_t ClockCache::Put(uint32_t id, uint32_t *evicted_id,
+                         const std::function<bool(uint32_t)> &evictable) {
+  uint32_t pos = cap + 1;
+  uint32_t evicted = NO_EVICTION;
+  if (size < cap) {
+    pos = size++;
+  } else {
+    // the first sweep may only clear reference bits, the second must find a
+    // block unless they are all kept by [evictable]
+    for (int step = 0; step < 2 * cap; ++step) {
+      uint32_t cur = hand;
+      hand = (hand + 1) % cap;
+      if (evictable && !evictable(cur)) continue;
+      if (referenced[cur].exchange(false)) continue;
+      pos = cur;
+      break;
+    }
+    if (pos >= (uint32_t)cap) return pos;
+    evicted = ids[pos];
+    positions.erase(evicted);
+  }
+  if (evicted_id) *evicted_id = evicted;
+
+  ids[pos] = id;
+  referenced[pos] = false;
+  positions[id] = pos;
+  return pos;
+}
+
+void ClockCache::ForEach(
+    const std::function<void(uint32_t, uint32_t)> &visit) {
+  for (std::unordered_map<uint32_t, uint32_t>::iterator it = positions.begin();
+       it != positions.end(); ++it)
+    visit(it->first, it->second);
+}
+
+///////////////////////////////////////////////////////////////
+// TwoQCache implementation
+///////////////////////////////////////////////////////////////
+
+// the sizes recommended by the paper: A1in a quarter of the cache, and A1out
+// remembering half as many ids as the cache holds
+TwoQCache::TwoQCache(int _cap)
+    : cap(_cap),
+      size(0),
+      kin(std::max(1, _cap / 4)),
+      kout(std::max(1, _cap / 2)) {}
+
+uint32_t TwoQCache::Get(uint32_t id) {
+  std::unordered_map<uint32_t, Entry>::iterator it = resident.find(id);
+  if (it == resident.end()) return cap + 1;
+  // hits in A1in leave it alone, it is a FIFO
+  if (it->second.in_am) {
+    std::unique_lock<std::mutex> lock(touch_lock, std::try_to_lock);
+    if (lock.owns_lock()) am.splice(am.begin(), am, it->second.it);
+  }
+  return it->second.pos;
+}
+
+uint32_t TwoQCache::Find(uint32_t id) {
+  std::unordered_map<uint32_t, Entry>::iterator it = resident.find(id);
+  if (it == resident.end()) return cap + 1;
+  return it->second.pos;
+}
+
+const uint32_t *TwoQCache::Victim(
+    const std::list<uint32_t> &queue,
+    const std::function<bool(uint32_t)> &evictable) {
+  for (std::list<uint32_t>::const_reverse_iterator it = queue.rbegin();
+       it != queue.rend(); ++it) {
+    if (!evictable || evictable(resident[*it].pos)) return &*it;
+  }
+  return nullptr;
+}
+
+uint32_t TwoQCache::Put(uint32_t id, uint32_t *evicted_id,
+                        const std::function<bool(uint32_t)> &evictable) {
+  uint32_t pos;
+  uint32_t evicted = NO_EVICTION;
+  if (size < cap) {
+    pos = size++;
+  } else {
+    // drop from A1in while it is over its share, as long as it can
+    bool from_a1in = (int)a1in.size() > kin || am.empty();
+    const uint32_t *victim = Victim(from_a1in ? a1in : am, evictable);
+    if (!victim) {
+      from_a1in = !from_a1in;
+      victim = Victim(from_a1in ? a1in : am, evictable);
+    }
+    if (!victim) return cap + 1;
+
+    evicted = *victim;
+    Entry entry = resident[evicted];
+    pos = entry.pos;
+    (from_a1in ? a1in : am).erase(entry.it);
+    resident.erase(evicted);
+    if (from_a1in) {
+      a1out.push_front(evicted);
+      ghosts[evicted] = a1out.begin();
+      if ((int)a1out.size() > kout) {
+        ghosts.erase(a1out.back());
+        a1out.pop_back();
+      }
+    }
+  }
+  if (evicted_id) *evicted_id = evicted;
+
+  // requested again while remembered: it goes straight to the main queue
+  std::unordered_map<uint32_t, std::list<uint32_t>::iterator>::iterator ghost =
+      ghosts.find(id);
+  Entry entry;
+  entry.pos = pos;
+  entry.in_am = ghost != ghosts.end();
+  if (entry.in_am) {
+    a1out.erase(ghost->second);
+    ghosts.erase(ghost);
+    am.push_front(id);
+    entry.it = am.begin();
+  } else {
+    a1in.push_front(id);
+    entry.it = a1in.begin();
+  }
+  resident[id] = entry;
+  return pos;
+}
+
+void TwoQCache::ForEach(
+    const std::function<void(uint32_t, uint32_t)> &visit) {
+  for (std::unordered_map<uint32_t, Entry>::iterator it = resident.begin();
+       it != resident.end(); ++it)
+    visit(it->first, it->second.pos);
+}
+
+///////////////////////////////////////////////////////////////
+// ARCCache implementation
+///////////////////////////////////////////////////////////////
+
+ARCCache::ARCCache(int _cap) : cap(_cap), size(0), p(0) {}
+
+uint32_t ARCCache::Get(uint32_t id) {
+  std::unordered_map<uint32_t, Entry>::iterator it = resident.find(id);
+  if (it == resident.end()) return cap + 1;
+  // a second hit makes it frequent
+  std::unique_lock<std::mutex> lock(touch_lock, std::try_to_lock);
+  if (lock.owns_lock()) {
+    t2.splice(t2.begin(), it->second.in_t2 ? t2 : t1, it->second.it);
+    it->second.in_t2 = true;
+  }
+  return it->second.pos;
+}
+
+uint32_t ARCCache::Find(uint32_t id) {
+  std::unordered_map<uint32_t, Entry>::iterator it = resident.find(id);
+  if (it == resident.end()) return cap + 1;
+  return it->second.pos;
+}
+
+const uint32_t *ARCCache::Victim(
+    const std::list<uint32_t> &list,
+    const std::function<bool(uint32_t)> &evictable) {
+  for (std::list<uint32_t>::const_reverse_iterator it = list.rbegin();
+       it != list.rend(); ++it) {
+    if (!evictable || evictable(resident[*it].pos)) return &*it;
+  }
+  return nullptr;
+}
+
+void ARCCache::Forget(std::list<uint32_t> &ghost_list) {
+  ghosts.erase(ghost_list.back());
+  ghost_list.pop_back();
+}
+
+uint32_t ARCCache::Put(uint32_t id, uint32_t *evicted_id,
+                       const std::function<bool(uint32_t)> &evictable) {
+  // a hit on a remembered id grows the target of the list that dropped it
+  std::unordered_map<uint32_t,
+                     std::pair<bool, std::list<uint32_t>::iterator> >::iterator
+      ghost = ghosts.find(id);
+  bool remembered = ghost != ghosts.end();
+  bool in_b2 = remembered && ghost->second.first;
+  double new_p = p;
+  if (remembered && !in_b2) {
+    double delta = b1.size() >= b2.size() ? 1.0 : (double)b2.size() / b1.size();
+    new_p = std::min((double)cap, p + delta);
+  } else if (remembered) {
+    double delta = b2.size() >= b1.size() ? 1.0 : (double)b1.size() / b2.size();
+    new_p = std::max(0.0, p - delta);
+  }
+
+  uint32_t pos;
+  uint32_t evicted = NO_EVICTION;
+  if (size < cap) {
+    pos = size++;
+  } else {
+    // drop from t1 while it is over its target
+    bool from_t1 = !t1.empty() && ((double)t1.size() > new_p ||
+                                   (in_b2 && (double)t1.size() == new_p));
+    const uint32_t *victim = Victim(from_t1 ? t1 : t2, evictable);
+    if (!victim) {
+      from_t1 = !from_t1;
+      victim = Victim(from_t1 ? t1 : t2, evictable);
+    }
+    if (!victim) return cap + 1;
+
+    evicted = *victim;
+    Entry entry = resident[evicted];
+    pos = entry.pos;
+    (from_t1 ? t1 : t2).erase(entry.it);
+    resident.erase(evicted);
+    std::list<uint32_t> &ghost_list = from_t1 ? b1 : b2;
+    ghost_list.push_front(evicted);
+    ghosts[evicted] = std::make_pair(!from_t1, ghost_list.begin());
+  }
+  if (evicted_id) *evicted_id = evicted;
+  p = new_p;
+
+  Entry entry;
+  entry.pos = pos;
+  entry.in_t2 = remembered;
+  if (remembered) {
+    // look it up again, remembering the dropped block may have rehashed
+    ghost = ghosts.find(id);
+    (in_b2 ? b2 : b1).erase(ghost->second.second);
+    ghosts.erase(ghost);
+    t2.push_front(id);
+    entry.it = t2.begin();
+  } else {
+    t1.push_front(id);
+    entry.it = t1.begin();
+  }
+  resident[id] = entry;
+
+  // remember at most [cap] ids per side and [2 * cap] in all
+  while (t1.size() + b1.size() > (size_t)cap && !b1.empty()) Forget(b1);
+  while (t1.size() + t2.size() + b1.size() + b2.size() > 2 * (size_t)cap &&
+         !b2.empty())
+    Forget(b2);
+  return pos;
+}
+
+void ARCCache::ForEach(const std::function<void(uint32_t, uint32_t)> &visit) {
+  for (std::unordered_map<uint32_t, Entry>::iterator it = resident.begin();
+       it != resident.end(); ++it)
+    visit(it->first, it->second.pos);
+}
@@ -34,13 +34,15 @@ void LRULinkedList::MoveNodeToHead(LRUNode *node) {
   head->next = node;
 }
 
+void LRULinkedList::RemoveNode(LRUNode *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  delete node;
+}
+
 void LRULinkedList::RemoveRearNode() {
   if (rear->prev == head) return;  // empty
-
-  LRUNode *temp = rear->prev;
-  rear->prev->prev->next = rear;
-  rear->prev = rear->prev->prev;
-  delete temp;
+  RemoveNode(rear->prev);
 }
 
 LRUNode *LRULinkedList::GetRearNode() {
@@ -48,6 +50,11 @@ LRUNode *LRULinkedList::GetRearNode() {
   return rear->prev;
 }
 
+LRUNode *LRULinkedList::GetPrevNode(LRUNode *node) {
+  if (node->prev == head) return nullptr;
+  return node->prev;
+}
+
 ///////////////////////////////////////////////////////////////
 // LRUCache implementation
 ///////////////////////////////////////////////////////////////
@@ -68,25 +75,36 @@ uint32_t LRUCache::Get(uint32_t id) {
   // fprintf(stderr, "get called: %u\n", id);
   std::unordered_map<uint32_t, LRUNode *>::iterator it = node_hash.find(id);
   if (it == node_hash.end()) return cap + 1;
-  node_list->MoveNodeToHead(it->second);
+  std::unique_lock<std::mutex> lock(touch_lock, std::try_to_lock);
+  if (lock.owns_lock()) node_list->MoveNodeToHead(it->second);
   return it->second->pos;
 }
 
-uint32_t LRUCache::Put(uint32_t id, uint32_t *evicted_id) {
+uint32_t LRUCache::Find(uint32_t id) {
+  std::unordered_map<uint32_t, LRUNode *>::iterator it = node_hash.find(id);
+  if (it == node_hash.end()) return cap + 1;
+  return it->second->pos;
+}
+
+uint32_t LRUCache::Put(uint32_t id, uint32_t *evicted_id,
+                       const std::function<bool(uint32_t)> &evictable) {
   // fprintf(stderr, "put called: %u\n", id);
   uint32_t pos = Get(id);
-  if (pos >= cap) {     // need to put the block
-    if (size == cap) {  // need to evict
+  if (pos >= (uint32_t)cap) {  // need to put the block
+    if (size == cap) {          // need to evict
       // fprintf(stderr, "put doing eviction\n");
       LRUNode *to_evict = node_list->GetRearNode();
+      while (to_evict && evictable && !evictable(to_evict->pos))
+        to_evict = node_list->GetPrevNode(to_evict);
+      if (!to_evict) return cap + 1;
       pos = to_evict->pos;  // take the block position of the evicted block
       if (evicted_id) *evicted_id = to_evict->id;
       node_hash.erase(to_evict->id);
-      node_list->RemoveRearNode();
+      node_list->RemoveNode(to_evict);
       --size;
     } else {  // get the next open block
       // fprintf(stderr, "put just inserting\n");
-      *evicted_id = 0;  // id is never 0
+      if (evicted_id) *evicted_id = NO_EVICTION;
       pos = size;
     }
     // add block to list
@@ -97,10 +115,8 @@ uint32_t LRUCache::Put(uint32_t id, uint32_t *evicted_id) {
   return pos;
 }
 
-std::unordered_map<uint32_t, LRUNode *>::iterator LRUCache::GetBegin() {
-  return node_hash.begin();
-}
-
-std::unordered_map<uint32_t, LRUNode *>::iterator LRUCache::GetEnd() {
-  return node_hash.end();
+void LRUCache::ForEach(const std::function<void(uint32_t, uint32_t)> &visit) {
+  for (std::unordered_map<uint32_t, LRUNode *>::iterator it = node_hash.begin();
+       it != node_hash.end(); ++it)
+    visit(it->first, it->second->pos);
 }
@@ -1,12 +1,23 @@
-#include <cassert>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 
 #include <be_tree/be_tree.hpp>
 
+// Exits with an error unless [key] is in [tree] with [value]. Not an
+// assert, which release builds compile out.
+static void CheckQuery(BeTree<> &tree, uint32_t key, uint32_t value) {
+  uint32_t q = 0;
+  if (!tree.Query(key, q) || q != value) {
+    fprintf(stderr, "lookup of %u failed\n", key);
+    exit(1);
+  }
+}
+
 int main() {
   std::cout << "Startup!" << std::endl;
-  BeTree tree("tree");
+  BeTree<> tree("tree");
   uint32_t size = 100000u;
   uint32_t test = 1;
 
@@ -14,22 +25,20 @@ int main() {
     case 0:
       for (uint32_t i = 1u; i <= size; i++) {
         tree.Insert(i, i);
-        uint32_t q = tree.Query(i);
-        assert(q == i);
+        CheckQuery(tree, i, i);
       }
       for (uint32_t i = 1u; i <= size; i++) {
-        uint32_t q = tree.Query(i);
-        assert(q == i);
+        CheckQuery(tree, i, i);
       }
       break;
 
     case 1:
       for (int i = size; i >= 1u; i--) {
         tree.Insert(i, size - i);
-        assert(tree.Query(i) == size - i);
+        CheckQuery(tree, i, size - i);
       }
       for (int i = 1u; i <= size; i++) {
-        assert(tree.Query(i) == size - i);
+        CheckQuery(tree, i, size - i);
       }
       break;
   }
@@ -0,0 +1,73 @@
+// Queries from more threads than the block cache has frames, alongside a
+// writer, so every frame can be pinned by a query at once. A query that
+// waited for a frame while holding one would hang here, the alarm turns that
+// into a failure.
+//
+// Usage: concurrency [num_threads], run from the repository root
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <be_tree/be_tree.hpp>
+
+static void Check(bool cond, const char *const format...) {
+  va_list args;
+  va_start(args, format);
+  if (!cond) {
+    fprintf(stderr, "concurrency: ");
+    vfprintf(stderr, format, args);
+    exit(1);
+  }
+  va_end(args);
+}
+
+static const uint32_t NUM_KEYS = 200000;
+static const uint32_t CACHE_BLOCKS = 16;
+static const int NUM_PASSES = 4;
+
+int main(int argc, char **argv) {
+  uint32_t num_threads = argc > 1 ? atoi(argv[1]) : 4 * CACHE_BLOCKS;
+  Check(num_threads >= CACHE_BLOCKS, "use at least %u threads\n",
+        CACHE_BLOCKS);
+  alarm(300);
+  mkdir("./build/app", 0755);
+  mkdir("./build/app/concurrency", 0755);
+
+  BeTree<> tree("concurrency", CACHE_BLOCKS);
+  // even keys are there from the start, odd keys are added during the queries
+  for (uint32_t key = 0; key < NUM_KEYS; key += 2) tree.Insert(key, key);
+
+  std::atomic<uint32_t> failures(0);
+  std::thread writer([&] {
+    for (uint32_t key = 1; key < NUM_KEYS; key += 2) tree.Insert(key, key);
+  });
+  std::vector<std::thread> readers;
+  for (uint32_t t = 0; t < num_threads; ++t) {
+    readers.emplace_back([&, t] {
+      for (int pass = 0; pass < NUM_PASSES; ++pass) {
+        for (uint32_t key = t * 2; key < NUM_KEYS; key += 2 * num_threads) {
+          uint32_t value;
+          if (!tree.Query(key, value) || value != key) failures++;
+        }
+      }
+    });
+  }
+  writer.join();
+  for (auto &reader : readers) reader.join();
+  Check(failures == 0, "%u queries failed\n", failures.load());
+
+  for (uint32_t key = 0; key < NUM_KEYS; ++key) {
+    uint32_t value;
+    Check(tree.Query(key, value) && value == key, "lookup of %u failed\n",
+          key);
+  }
+  fprintf(stderr, "concurrency: ok with %u threads\n", num_threads);
+  return 0;
+}
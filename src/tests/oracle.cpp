@@ -0,0 +1,467 @@
+// Random operations against std::map, checked by scans and lookups, on
+// integer and string keys. Exits with an error at the first difference.
+//
+// Usage: oracle [num_ops], run from the repository root
+
+#include <sys/stat.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <be_tree/be_tree.hpp>
+
+static void Check(bool cond, const char *const format...) {
+  va_list args;
+  va_start(args, format);
+  if (!cond) {
+    fprintf(stderr, "oracle: ");
+    vfprintf(stderr, format, args);
+    exit(1);
+  }
+  va_end(args);
+}
+
+typedef std::map<uint32_t, uint32_t> Reference;
+
+static void MakeFolder(const std::string &name) {
+  mkdir("./build/app", 0755);
+  mkdir(("./build/app/" + name).c_str(), 0755);
+}
+
+// Compares the pairs of [tree] with [lo] <= key < [hi] with [ref]
+template <class Tree>
+static void CheckScan(Tree &tree, const Reference &ref, uint32_t lo,
+                      uint32_t hi, const char *what) {
+  std::vector<std::pair<uint32_t, uint32_t> > pairs = tree.Scan(lo, hi);
+  auto it = ref.lower_bound(lo), end = ref.lower_bound(hi);
+  size_t expected = std::distance(it, end);
+  Check(pairs.size() == expected,
+        "%s: scan of [%u, %u) found %zu pairs, expected %zu\n", what, lo, hi,
+        pairs.size(), expected);
+  for (auto &pair : pairs) {
+    Check(pair.first == it->first && pair.second == it->second,
+          "%s: scan found %u=%u, expected %u=%u\n", what, pair.first,
+          pair.second, it->first, it->second);
+    ++it;
+  }
+}
+
+// Compares every pair of [tree] with [ref], by a full scan and by lookups
+template <class Tree>
+static void CheckAll(Tree &tree, const Reference &ref, const char *what) {
+  CheckScan(tree, ref, 0, UINT32_MAX, what);
+  for (auto &kv : ref) {
+    uint32_t value;
+    Check(tree.Query(kv.first, value) && value == kv.second,
+          "%s: lookup of %u failed\n", what, kv.first);
+  }
+}
+
+// Checks a lookup of [key], which may be absent
+template <class Tree>
+static void CheckKey(Tree &tree, const Reference &ref, uint32_t key,
+                     const char *what) {
+  uint32_t value = 0;
+  bool found = tree.Query(key, value);
+  auto it = ref.find(key);
+  Check(found == (it != ref.end()), "%s: lookup of %u found %d\n", what, key,
+        found);
+  Check(!found || value == it->second, "%s: lookup of %u gave %u, not %u\n",
+        what, key, value, it->second);
+}
+
+// Applies a batch of random upserts of keys in [1, keyspace] to [tree], and
+// to [ref] one at a time
+template <class Tree>
+static void RandomBatch(Tree &tree, Reference &ref, uint32_t keyspace,
+                        std::mt19937 &rng) {
+  std::vector<BeUpsert<uint32_t, uint32_t> > batch(rng() % 1000 + 1);
+  for (BeUpsert<uint32_t, uint32_t> &upsert : batch) {
+    // a few hot keys, so keys repeat within the batch
+    upsert.key = rng() % 2 ? rng() % 64 + 1 : rng() % keyspace + 1;
+    auto it = ref.find(upsert.key);
+    if (rng() % 50 == 0) {
+      upsert.type = DELETE_RANGE;
+      upsert.end_key = upsert.key + rng() % 2000 + 1;
+      ref.erase(ref.lower_bound(upsert.key), ref.lower_bound(upsert.end_key));
+    } else if (it != ref.end() && rng() % 3 == 0) {
+      upsert.type = DELETE;
+      ref.erase(it);
+    } else if (rng() % 4 == 0) {
+      upsert.type = MERGE;
+      upsert.parameter = rng() % 1000;
+      ref[upsert.key] += upsert.parameter;
+    } else {
+      upsert.type = it == ref.end() ? INSERT : UPDATE;
+      upsert.parameter = rng() % 1000;
+      ref[upsert.key] = upsert.parameter;
+    }
+  }
+  tree.ApplyBatch(batch.data(), batch.size());
+}
+
+// Runs [num_ops] random inserts, updates, merges (adding to the value),
+// deletes, lookups and the odd range delete or batch of keys in
+// [1, keyspace], mirrored in [ref]
+template <class Tree>
+static void RandomOps(Tree &tree, Reference &ref, int num_ops,
+                      uint32_t keyspace, std::mt19937 &rng, const char *what) {
+  for (int i = 0; i < num_ops; ++i) {
+    uint32_t key = rng() % keyspace + 1;
+    uint32_t value = rng() % 1000;
+    auto it = ref.find(key);
+    int op = rng() % 1000;
+    if (op < 500) {
+      if (it == ref.end()) {
+        tree.Insert(key, value);
+        ref[key] = value;
+      } else {
+        tree.Update(key, value);
+        it->second = value;
+      }
+    } else if (op < 650) {
+      tree.Merge(key, value);
+      ref[key] += value;
+    } else if (op < 800) {
+      if (it != ref.end()) {
+        tree.Delete(key);
+        ref.erase(it);
+      }
+    } else if (op < 802) {
+      RandomBatch(tree, ref, keyspace, rng);
+    } else if (op < 804) {
+      uint32_t end = key + rng() % (keyspace / 50) + 1;
+      tree.DeleteRange(key, end);
+      ref.erase(ref.lower_bound(key), ref.lower_bound(end));
+    } else {
+      CheckKey(tree, ref, key, what);
+    }
+    if (i % 10007 == 0) {
+      uint32_t lo = rng() % keyspace;
+      CheckScan(tree, ref, lo, lo + rng() % 5000, what);
+    }
+  }
+}
+
+// Runs [num_ops] random operations on a new tree with a small cache, then
+// more after closing and reopening it
+template <class Tree>
+static void RunTree(const char *name, StorageMode mode,
+                    EvictionPolicyType policy, LeafFormat leaf_format,
+                    int num_ops, uint32_t seed) {
+  MakeFolder(name);
+  std::mt19937 rng(seed);
+  Reference ref;
+  {
+    Tree tree(name, 32, mode, policy, false, leaf_format,
+              &AddMerge<uint32_t>);
+    RandomOps(tree, ref, num_ops, 100000, rng, name);
+    CheckAll(tree, ref, name);
+  }
+  Tree tree(name, OPEN_TREE, 32, mode, policy, false, leaf_format,
+            &AddMerge<uint32_t>);
+  CheckAll(tree, ref, name);
+  RandomOps(tree, ref, num_ops / 4, 100000, rng, name);
+  CheckAll(tree, ref, name);
+}
+
+// Runs [num_ops] upserts of 1000 hot keys spread over a tree of 200000, so
+// a key sees many upserts, of every kind, while they wait in one buffer
+template <class Tree>
+static void HotKeys(const char *name, int num_ops, uint32_t seed) {
+  MakeFolder(name);
+  std::mt19937 rng(seed);
+  Reference ref;
+  Tree tree(name, 32, SINGLE_FILE, LRU_POLICY, false, PLAIN_LEAF,
+            &AddMerge<uint32_t>);
+  for (uint32_t key = 1; key <= 200000; ++key) {
+    tree.Insert(key, key);
+    ref[key] = key;
+  }
+  for (int i = 0; i < num_ops; ++i) {
+    uint32_t key = rng() % 1000 * 200 + 1;
+    uint32_t value = rng() % 1000;
+    auto it = ref.find(key);
+    int op = rng() % 10;
+    if (it == ref.end()) {
+      tree.Insert(key, value);
+      ref[key] = value;
+    } else if (op < 5) {
+      tree.Update(key, value);
+      it->second = value;
+    } else if (op < 8) {
+      tree.Merge(key, value);
+      it->second += value;
+    } else {
+      tree.Delete(key);
+      ref.erase(it);
+    }
+  }
+  CheckAll(tree, ref, name);
+}
+
+// Looks up every key around a sparse tree, before and after reopening it,
+// so most lookups are of absent keys and end at a leaf filter
+template <class Tree>
+static void Sparse(const char *name, uint32_t num_keys) {
+  MakeFolder(name);
+  Reference ref;
+  {
+    Tree tree(name, 32);
+    for (uint32_t key = 3; key <= 3 * num_keys; key += 3) {
+      tree.Insert(key, key);
+      ref[key] = key;
+    }
+    // leaves that lost keys keep filters of only the keys left
+    for (uint32_t key = 6; key <= 3 * num_keys; key += 6) {
+      tree.Delete(key);
+      ref.erase(key);
+    }
+    tree.DeleteRange(num_keys, 2 * num_keys);
+    ref.erase(ref.lower_bound(num_keys), ref.lower_bound(2 * num_keys));
+    for (uint32_t key = 0; key <= 3 * num_keys + 1; ++key)
+      CheckKey(tree, ref, key, name);
+  }
+  Tree tree(name, OPEN_TREE, 32);
+  for (uint32_t key = 0; key <= 3 * num_keys + 1; ++key)
+    CheckKey(tree, ref, key, name);
+  Check(tree.GetStats().filter_negatives > 0, "%s: no lookup used a filter\n",
+        name);
+}
+
+// Grows a tree, shrinks it until nodes merge and blocks are freed, grows it
+// again into the freed blocks, and reopens it
+template <class Tree>
+static void GrowAndShrink(const char *name, LeafFormat leaf_format,
+                          int num_ops, uint32_t seed) {
+  MakeFolder(name);
+  std::mt19937 rng(seed);
+  Reference ref;
+  uint32_t keyspace = 100000;
+  {
+    Tree tree(name, 32, SINGLE_FILE, LRU_POLICY, false, leaf_format,
+              &AddMerge<uint32_t>);
+    for (uint32_t key = 1; key <= keyspace; key += 2) {
+      tree.Insert(key, key);
+      ref[key] = key;
+    }
+    RandomOps(tree, ref, num_ops, keyspace, rng, name);
+    CheckAll(tree, ref, name);
+
+    // keep one key in twenty
+    for (uint32_t key = 1; key <= keyspace; key += 20) {
+      tree.DeleteRange(key + 1, key + 20);
+      ref.erase(ref.lower_bound(key + 1), ref.lower_bound(key + 20));
+    }
+    RandomOps(tree, ref, num_ops / 4, keyspace, rng, name);
+    CheckAll(tree, ref, name);
+    BeStats stats = tree.GetStats();
+    Check(stats.merges > 0, "%s: shrinking merged no nodes\n", name);
+    Check(stats.free_blocks > 0, "%s: shrinking freed no blocks\n", name);
+
+    // freed blocks are taken before new ones
+    uint64_t shrunk_blocks = stats.num_blocks, freed = stats.free_blocks;
+    bool grown = false;
+    for (uint32_t key = 1; key <= keyspace; ++key) {
+      if (ref.count(key)) continue;
+      tree.Insert(key, key);
+      ref[key] = key;
+      if (grown || key % 256 != 0) continue;
+      stats = tree.GetStats();
+      grown = stats.num_blocks > shrunk_blocks;
+      Check(!grown || stats.free_blocks < freed / 2,
+            "%s: took new blocks with %u of %u freed ones left\n", name,
+            (uint32_t)stats.free_blocks, (uint32_t)freed);
+    }
+    CheckAll(tree, ref, name);
+    Check(tree.GetStats().free_blocks < freed,
+          "%s: regrowing reused no blocks\n", name);
+  }
+  Tree tree(name, OPEN_TREE, 32, SINGLE_FILE, LRU_POLICY, false, leaf_format,
+            &AddMerge<uint32_t>);
+  CheckAll(tree, ref, name);
+  RandomOps(tree, ref, num_ops / 4, keyspace, rng, name);
+  CheckAll(tree, ref, name);
+}
+
+// Batches with more upserts for one key than a buffer holds
+template <class Tree>
+static void LongRuns(const char *name) {
+  MakeFolder(name);
+  Reference ref;
+  Tree tree(name, 32, SINGLE_FILE, LRU_POLICY, false, PLAIN_LEAF,
+            &AddMerge<uint32_t>);
+  for (uint32_t key = 1; key <= 10000; ++key) {
+    tree.Insert(key, key);
+    ref[key] = key;
+  }
+  std::vector<BeUpsert<uint32_t, uint32_t> > batch;
+  for (uint32_t i = 0; i < 400; ++i) {
+    BeUpsert<uint32_t, uint32_t> upsert;
+    upsert.key = 7;
+    upsert.type = MERGE;
+    upsert.parameter = 1;
+    batch.push_back(upsert);
+    ref[7] += 1;
+    // a key deleted and merged back into turns by the batch
+    upsert.key = 20000;
+    upsert.type = i % 2 ? DELETE : MERGE;
+    upsert.parameter = i;
+    batch.push_back(upsert);
+    if (i % 2)
+      ref.erase(20000);
+    else
+      ref[20000] += i;
+    // and a key updated, between other keys
+    upsert.key = i % 2 ? 5000 : 300 + i;
+    upsert.type = UPDATE;
+    batch.push_back(upsert);
+    ref[upsert.key] = i;
+  }
+  tree.ApplyBatch(batch.data(), batch.size());
+  CheckAll(tree, ref, name);
+}
+
+// Fills a new tree in ascending or descending key order, which sends every
+// flush to the same child
+template <class Tree>
+static void Fill(const char *name, bool ascending, uint32_t num_keys) {
+  MakeFolder(name);
+  Reference ref;
+  Tree tree(name, 32);
+  for (uint32_t i = 1; i <= num_keys; ++i) {
+    uint32_t key = ascending ? i : num_keys + 1 - i;
+    tree.Insert(key, i);
+    ref[key] = i;
+  }
+  CheckAll(tree, ref, name);
+}
+
+// Bulk loads a new tree, then updates it like any other
+static void BulkLoad(const char *name, double fill_factor, int num_ops,
+                     uint32_t seed) {
+  MakeFolder(name);
+  std::mt19937 rng(seed);
+  Reference ref;
+  for (int i = 0; i < 200000; ++i) ref[rng() % 1000000 + 1] = rng() % 1000;
+  BeTree<> tree(name, 32, SINGLE_FILE, LRU_POLICY, false, PLAIN_LEAF,
+                &AddMerge<uint32_t>);
+  tree.BulkLoad(ref.begin(), ref.end(), fill_factor);
+  CheckAll(tree, ref, name);
+  RandomOps(tree, ref, num_ops, 1000000, rng, name);
+  CheckAll(tree, ref, name);
+}
+
+// String keys and values, which take the generic (non-SIMD) paths
+static void StringKeys(int num_ops, uint32_t seed) {
+  typedef FixedString<32> Key;
+  typedef FixedString<16> Value;
+  const char *name = "oracle_strings";
+  MakeFolder(name);
+  std::mt19937 rng(seed);
+  std::map<std::string, std::string> ref;
+  BeTree<4096, 50, Key, Value> tree(name, 32);
+  for (int i = 0; i < num_ops; ++i) {
+    std::string key = "key" + std::to_string(rng() % 20000);
+    std::string value = std::to_string(rng());
+    auto it = ref.find(key);
+    int op = rng() % 10;
+    if (op < 5) {
+      if (it == ref.end())
+        tree.Insert(Key::From(key), Value::From(value));
+      else
+        tree.Update(Key::From(key), Value::From(value));
+      ref[key] = value;
+    } else if (op < 7 && it != ref.end()) {
+      tree.Delete(Key::From(key));
+      ref.erase(it);
+    } else {
+      Value found;
+      bool present = tree.Query(Key::From(key), found);
+      Check(present == (it != ref.end()) &&
+                (!present || found.str() == it->second),
+            "%s: lookup of %s failed\n", name, key.c_str());
+    }
+  }
+  auto pairs = tree.Scan(Key::From(""), Key::From(std::string(32, '\xff')));
+  Check(pairs.size() == ref.size(), "%s: scan found %zu pairs, not %zu\n",
+        name, pairs.size(), ref.size());
+  auto it = ref.begin();
+  for (auto &pair : pairs) {
+    Check(pair.first.str() == it->first && pair.second.str() == it->second,
+          "%s: scan found %s, expected %s\n", name, pair.first.str().c_str(),
+          it->first.c_str());
+    ++it;
+  }
+}
+
+// Alternating merges and deletes of one string key, on a geometry whose
+// buffers hold more upserts than a leaf flush takes, then appends to it
+static void MergeDeleteRun() {
+  typedef FixedString<32> Key;
+  typedef FixedString<16> Value;
+  const char *name = "oracle_merge_delete";
+  MakeFolder(name);
+  BeTree<4096, 50, Key, Value> tree(name, 32, SINGLE_FILE, LRU_POLICY, false,
+                                    PLAIN_LEAF, &AppendMerge<16>);
+  Key key = Key::From("hot");
+  for (int i = 0; i < 200; ++i) {
+    tree.Merge(key, Value::From("x"));
+    tree.Delete(key);
+  }
+  Value value;
+  Check(!tree.Query(key, value), "%s: found a deleted key\n", name);
+  tree.Merge(key, Value::From("ab"));
+  tree.Merge(key, Value::From("c"));
+  Check(tree.Query(key, value) && value.str() == "abc",
+        "%s: merges gave \"%s\", not \"abc\"\n", name, value.str().c_str());
+  for (int i = 0; i < 200; ++i) {
+    tree.Delete(key);
+    tree.Merge(key, Value::From("d"));
+  }
+  Check(tree.Query(key, value) && value.str() == "d",
+        "%s: merges gave \"%s\", not \"d\"\n", name, value.str().c_str());
+  Check(tree.Scan(key, Key::From("hou")).size() == 1,
+        "%s: scan found other than one pair\n", name);
+}
+
+int main(int argc, char **argv) {
+  int num_ops = argc > 1 ? atoi(argv[1]) : 200000;
+  typedef BeTree<> Tree;
+  RunTree<Tree>("oracle", SINGLE_FILE, LRU_POLICY, PLAIN_LEAF, num_ops, 1);
+  RunTree<Tree>("oracle_mmap", MMAP, LRU_POLICY, PLAIN_LEAF, num_ops, 2);
+  RunTree<Tree>("oracle_per_block", FILE_PER_BLOCK, LRU_POLICY, PLAIN_LEAF,
+                num_ops / 4, 3);
+  RunTree<Tree>("oracle_clock", SINGLE_FILE, CLOCK_POLICY, PLAIN_LEAF, num_ops,
+                4);
+  RunTree<Tree>("oracle_2q", SINGLE_FILE, TWO_Q_POLICY, PLAIN_LEAF, num_ops, 5);
+  RunTree<Tree>("oracle_arc", SINGLE_FILE, ARC_POLICY, PLAIN_LEAF, num_ops, 6);
+  RunTree<BeTree<4096, 30> >("oracle_eps30", SINGLE_FILE, LRU_POLICY,
+                             PLAIN_LEAF, num_ops, 7);
+  RunTree<BeTree<65536, 50> >("oracle_64k", SINGLE_FILE, LRU_POLICY,
+                              PLAIN_LEAF, num_ops, 8);
+  RunTree<Tree>("oracle_packed", SINGLE_FILE, LRU_POLICY, PACKED_LEAF, num_ops,
+                11);
+  RunTree<BeTree<4096, 30> >("oracle_packed_eps30", SINGLE_FILE, LRU_POLICY,
+                             PACKED_LEAF, num_ops, 12);
+  HotKeys<Tree>("oracle_hot", num_ops, 14);
+  Sparse<Tree>("oracle_sparse", num_ops / 2);
+  GrowAndShrink<Tree>("oracle_shrink", PLAIN_LEAF, num_ops, 15);
+  GrowAndShrink<Tree>("oracle_shrink_packed", PACKED_LEAF, num_ops, 16);
+  GrowAndShrink<BeTree<4096, 30> >("oracle_shrink_eps30", PLAIN_LEAF, num_ops,
+                                   17);
+  LongRuns<Tree>("oracle_long_runs");
+  Fill<Tree>("oracle_ascending", true, num_ops);
+  Fill<Tree>("oracle_descending", false, num_ops);
+  BulkLoad("oracle_bulk", 1.0, num_ops / 2, 9);
+  BulkLoad("oracle_bulk_half", 0.5, num_ops / 2, 10);
+  StringKeys(num_ops / 2, 13);
+  MergeDeleteRun();
+  fprintf(stderr, "oracle: ok\n");
+  return 0;
+}
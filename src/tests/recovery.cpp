@@ -0,0 +1,227 @@
+// Reopening trees: each round reopens the tree, changes it through a cache
+// small enough to evict every block, the superblock included, and closes
+// it. The reopened tree must match a std::map. A tree whose process died
+// without closing it must be refused, and a modified block 0 (where the
+// superblock lives) must be written back when it is evicted.
+//
+// Crash recovery of durable trees: a child process inserts from several
+// threads, reporting each insert on a pipe once it returns, and is killed
+// mid-write. The reopened tree must hold every reported pair, and nothing
+// but those and the inserts in flight. Repeats over the same tree, for each
+// storage mode with a log.
+//
+// Usage: recovery [rounds], run from the repository root
+
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <be_tree/be_tree.hpp>
+
+static void Check(bool cond, const char *const format...) {
+  va_list args;
+  va_start(args, format);
+  if (!cond) {
+    fprintf(stderr, "recovery: ");
+    vfprintf(stderr, format, args);
+    exit(1);
+  }
+  va_end(args);
+}
+
+// Small enough for every round to evict the superblock
+static const uint32_t CACHE_BLOCKS = 8;
+static const int NUM_WRITERS = 4;
+
+typedef std::map<uint32_t, uint32_t> Reference;
+
+static void CheckTree(BeTree<> &tree, const Reference &ref, const char *name,
+                      int round) {
+  std::vector<std::pair<uint32_t, uint32_t> > pairs =
+      tree.Scan(0, UINT32_MAX);
+  Check(pairs.size() == ref.size(), "%s: round %d found %zu pairs, not %zu\n",
+        name, round, pairs.size(), ref.size());
+  auto it = ref.begin();
+  for (auto &pair : pairs) {
+    Check(pair.first == it->first && pair.second == it->second,
+          "%s: round %d found %u=%u, expected %u=%u\n", name, round,
+          pair.first, pair.second, it->first, it->second);
+    ++it;
+  }
+}
+
+static void ReopenRounds(const char *name, StorageMode mode, int rounds) {
+  std::string folder = std::string("./build/app/") + name;
+  mkdir("./build/app", 0755);
+  system(("rm -rf " + folder).c_str());
+  mkdir(folder.c_str(), 0755);
+  { BeTree<> tree(name, CACHE_BLOCKS, mode); }
+
+  std::mt19937 rng(mode);
+  Reference ref;
+  for (int round = 0; round < rounds; ++round) {
+    BeTree<> tree(name, OPEN_TREE, CACHE_BLOCKS, mode);
+    CheckTree(tree, ref, name, round);
+    for (int i = 0; i < 20000; ++i) {
+      uint32_t key = rng() % 50000;
+      auto it = ref.find(key);
+      if (it == ref.end()) {
+        tree.Insert(key, i);
+        ref[key] = i;
+      } else if (rng() % 4 == 0) {
+        tree.Delete(key);
+        ref.erase(it);
+      } else {
+        tree.Update(key, i);
+        it->second = i;
+      }
+    }
+  }
+  BeTree<> tree(name, OPEN_TREE, CACHE_BLOCKS, mode);
+  CheckTree(tree, ref, name, rounds);
+}
+
+// Opens the tree [name] and exits without closing it, then checks that
+// reopening it fails
+static void Unclosed(const char *name, StorageMode mode) {
+  fflush(stdout);
+  pid_t pid = fork();
+  Check(pid >= 0, "fork failed\n");
+  if (pid == 0) {
+    BeTree<> tree(name, OPEN_TREE, CACHE_BLOCKS, mode);
+    tree.Insert(UINT32_MAX - 1, 0);
+    _exit(0);
+  }
+  waitpid(pid, nullptr, 0);
+
+  pid = fork();
+  Check(pid >= 0, "fork failed\n");
+  if (pid == 0) {
+    freopen("/dev/null", "w", stderr);
+    BeTree<> tree(name, OPEN_TREE, CACHE_BLOCKS, mode);
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  Check(WIFEXITED(status) && WEXITSTATUS(status) != 0,
+        "%s: a tree that was not closed was reopened\n", name);
+}
+
+// Modifies block 0 of a store and evicts it, then checks a reopened store
+// reads it back
+static void EvictBlockZero(const char *name) {
+  std::string folder = std::string("./build/app/") + name;
+  mkdir(folder.c_str(), 0755);
+  const char pattern[] = "block zero";
+  {
+    BlockManager<4096> bmanager(name, SINGLE_FILE, 2);
+    {
+      BlockHandle<4096> block = bmanager.Pin(0);
+      memcpy(block.Get()->block_buf, pattern, sizeof(pattern));
+      bmanager.MarkDirty(0);
+    }
+    for (int i = 0; i < 4; ++i) bmanager.Pin(bmanager.CreateBlock());
+  }
+  BlockManager<4096> bmanager(name, SINGLE_FILE, 2, LRU_POLICY, true);
+  bmanager.SetNumBlocks(4);
+  BlockHandle<4096> block = bmanager.Pin(0);
+  Check(memcmp(block.Get()->block_buf, pattern, sizeof(pattern)) == 0,
+        "%s: block 0 was not written back when it was evicted\n", name);
+}
+
+// Inserts from [NUM_WRITERS] threads into the durable tree [name] until
+// killed, writing each key and value to [fd] after the insert returns
+static void RunChild(const char *name, StorageMode mode, int round, int fd) {
+  BeTree<> tree(name, OPEN_TREE, CACHE_BLOCKS, mode, LRU_POLICY, true);
+  std::vector<std::thread> writers;
+  for (int w = 0; w < NUM_WRITERS; ++w) {
+    writers.emplace_back([&tree, round, w, fd] {
+      std::mt19937 rng(round * NUM_WRITERS + w);
+      // keys are disjoint between writers and rounds
+      for (uint32_t i = 0;; ++i) {
+        uint32_t pair[2] = {(uint32_t)(round * NUM_WRITERS + w) << 20 | i,
+                            (uint32_t)rng()};
+        tree.Insert(pair[0], pair[1]);
+        if (write(fd, pair, sizeof(pair)) != sizeof(pair)) _exit(1);
+      }
+    });
+  }
+  for (auto &writer : writers) writer.join();
+  _exit(0);
+}
+
+static void CrashRounds(const char *name, StorageMode mode, int rounds) {
+  std::string folder = std::string("./build/app/") + name;
+  system(("rm -rf " + folder).c_str());
+  mkdir(folder.c_str(), 0755);
+  { BeTree<> tree(name, CACHE_BLOCKS, mode, LRU_POLICY, true); }
+
+  Reference acked;
+  for (int round = 0; round < rounds; ++round) {
+    int fds[2];
+    Check(pipe(fds) == 0, "pipe failed\n");
+    fflush(stdout);
+    pid_t pid = fork();
+    Check(pid >= 0, "fork failed\n");
+    if (pid == 0) {
+      close(fds[0]);
+      RunChild(name, mode, round, fds[1]);
+    }
+    close(fds[1]);
+
+    size_t num_acked = 0;
+    std::thread reader([&] {
+      uint32_t pair[2];
+      while (read(fds[0], pair, sizeof(pair)) == sizeof(pair)) {
+        acked[pair[0]] = pair[1];
+        num_acked++;
+      }
+    });
+    usleep(150000 + round * 50000);
+    kill(pid, SIGKILL);
+    reader.join();
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+    Check(num_acked > 0, "%s: round %d inserted nothing\n", name, round);
+
+    BeTree<> tree(name, OPEN_TREE, CACHE_BLOCKS, mode, LRU_POLICY, true);
+    std::vector<std::pair<uint32_t, uint32_t> > pairs =
+        tree.Scan(0, UINT32_MAX);
+    Check(pairs.size() >= acked.size() &&
+              pairs.size() <= acked.size() + NUM_WRITERS,
+          "%s: round %d found %zu pairs, %zu acknowledged\n", name, round,
+          pairs.size(), acked.size());
+    Reference found(pairs.begin(), pairs.end());
+    for (auto &pair : acked) {
+      auto it = found.find(pair.first);
+      Check(it != found.end() && it->second == pair.second,
+            "%s: round %d lost %u\n", name, round, pair.first);
+    }
+    // the inserts in flight may or may not have made it, either is fine
+    acked.swap(found);
+  }
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 5;
+  ReopenRounds("recovery_single", SINGLE_FILE, rounds);
+  ReopenRounds("recovery_per_block", FILE_PER_BLOCK, rounds);
+  ReopenRounds("recovery_mmap", MMAP, rounds);
+  Unclosed("recovery_single", SINGLE_FILE);
+  EvictBlockZero("recovery_block_zero");
+  CrashRounds("recovery_crash_single", SINGLE_FILE, rounds);
+  CrashRounds("recovery_crash_per_block", FILE_PER_BLOCK, rounds);
+  fprintf(stderr, "recovery: ok\n");
+  return 0;
+}
@@ -0,0 +1,138 @@
+#include <wal/wal.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static void IOFail(std::string error_msg) {
+  perror(error_msg.c_str());
+  exit(1);
+}
+
+// FNV-1a, enough to tell a torn record from a whole one
+static uint32_t Checksum(const char *data, uint32_t size) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < size; ++i) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static const size_t RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+
+WriteAheadLog::WriteAheadLog(std::string filename)
+    : last_lsn(0),
+      synced_lsn(0),
+      syncing(false),
+      size(0),
+      num_syncs(0),
+      num_commits(0),
+      num_bytes_written(0) {
+  fd = open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) IOFail("Opening log " + filename + " failed!");
+  off_t end = lseek(fd, 0, SEEK_END);
+  if (end < 0) IOFail("Reading size of log " + filename + " failed!");
+  size = end;
+}
+
+WriteAheadLog::~WriteAheadLog() {
+  if (synced_lsn < last_lsn) Commit(last_lsn);
+  close(fd);
+  printf("num log syncs: %d for %d commits\n", num_syncs, num_commits);
+}
+
+uint64_t WriteAheadLog::Append(const void *record, uint32_t record_size) {
+  uint32_t header[2] = {record_size,
+                        Checksum((const char *)record, record_size)};
+  std::lock_guard<std::mutex> guard(lock);
+  pending.insert(pending.end(), (const char *)header,
+                 (const char *)header + RECORD_HEADER_SIZE);
+  pending.insert(pending.end(), (const char *)record,
+                 (const char *)record + record_size);
+  size += RECORD_HEADER_SIZE + record_size;
+  return ++last_lsn;
+}
+
+void WriteAheadLog::Commit(uint64_t lsn) {
+  std::unique_lock<std::mutex> guard(lock);
+  num_commits++;
+  while (synced_lsn < lsn) {
+    if (syncing) {
+      synced.wait(guard);
+      continue;
+    }
+
+    // lead the next group: write everything appended so far with one sync,
+    // while later writers keep appending
+    syncing = true;
+    std::vector<char> group;
+    group.swap(pending);
+    uint64_t group_lsn = last_lsn;
+    guard.unlock();
+    size_t done = 0;
+    while (done < group.size()) {
+      ssize_t res = write(fd, group.data() + done, group.size() - done);
+      if (res < 0 && errno == EINTR) continue;
+      if (res <= 0) IOFail("Appending to log failed!");
+      done += res;
+    }
+    if (fdatasync(fd) != 0) IOFail("Syncing log failed!");
+    guard.lock();
+
+    syncing = false;
+    synced_lsn = std::max(synced_lsn, group_lsn);
+    num_syncs++;
+    num_bytes_written += group.size();
+    synced.notify_all();
+  }
+}
+
+void WriteAheadLog::Replay(const RecordVisitor &visit) {
+  std::vector<char> contents(size);
+  size_t done = 0;
+  while (done < contents.size()) {
+    ssize_t res = pread(fd, contents.data() + done, contents.size() - done,
+                        done);
+    if (res < 0 && errno == EINTR) continue;
+    if (res < 0) IOFail("Reading log failed!");
+    if (res == 0) break;
+    done += res;
+  }
+
+  size_t pos = 0;
+  while (pos + RECORD_HEADER_SIZE <= done) {
+    uint32_t header[2];
+    memcpy(header, contents.data() + pos, RECORD_HEADER_SIZE);
+    const char *record = contents.data() + pos + RECORD_HEADER_SIZE;
+    if (header[0] > done - pos - RECORD_HEADER_SIZE ||
+        Checksum(record, header[0]) != header[1])
+      break;  // torn by a crash, nothing after it was committed
+    visit(record, header[0]);
+    pos += RECORD_HEADER_SIZE + header[0];
+  }
+}
+
+void WriteAheadLog::Truncate() {
+  std::unique_lock<std::mutex> guard(lock);
+  synced.wait(guard, [this] { return !syncing; });
+  // not synced, the next commit syncs the new length
+  if (ftruncate(fd, 0) != 0) IOFail("Truncating log failed!");
+  pending.clear();
+  size = 0;
+  synced_lsn = last_lsn;
+  synced.notify_all();
+}
+
+size_t WriteAheadLog::Size() {
+  std::lock_guard<std::mutex> guard(lock);
+  return size;
+}
+
+uint64_t WriteAheadLog::BytesWritten() {
+  std::lock_guard<std::mutex> guard(lock);
+  return num_bytes_written;
+}